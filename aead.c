@@ -0,0 +1,291 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Eugene Zagidullin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/*
+Authenticated encryption of relayed datagrams with pre-shared key.
+
+Sealed data is: nonce | ciphertext | tag, associated data is passed separately
+and is not included. Nonce is a random per-process prefix and a 64-bit counter
+which starts from wall clock time in microseconds, so it keeps growing across
+restarts. Receiver rejects counters which fell behind the replay window.
+Counters already opened are reported by aead_check(), so copies of a datagram
+sealed once and sent through several relays are recognized without decrypting.
+Both directions share the key, so a datagram carrying our own prefix was
+sealed by us and reflected back by someone on the path; it is rejected.
+
+Fields which differ between paths are covered by a cheap per-path MAC
+(HMAC-SHA256 with a key derived from the same secret, truncated) computed
+over a few dozen bytes for every copy, see aead_sign(). It travels in a
+trailer together with sender's prefix and a counter of its own, so copies
+and fragments are authenticated and reflection is detected without opening
+them. The MAC also covers the number of the path, so a datagram can't be
+moved to another relay, and every relay keeps a replay window of path
+counters, so it can't be sent to the same relay twice either.
+
+OpenSSL picks the fastest implementation available (AES-NI, AVX2 etc.).
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <syslog.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+#include <openssl/crypto.h>
+
+#include "aead.h"
+#include "utils.h"
+#include "debug.h"
+
+#define DEF_CIPHER "aes-256-gcm"
+
+struct _aead_t {
+    EVP_CIPHER_CTX *seal_ctx;
+    EVP_CIPHER_CTX *open_ctx;
+
+    /* Keyed per-path MAC state copied for every datagram */
+    EVP_PKEY *mac_key;
+    EVP_MD_CTX *mac_init;
+    EVP_MD_CTX *mac_ctx;
+
+    uint32_t prefix;
+    uint64_t counter;
+    uint64_t path_counter;
+
+    aead_window_t window;
+};
+
+static const EVP_CIPHER *aead_cipher(const char *name) {
+    static const char *ciphers = "aes-256-gcm\0chacha20-poly1305\0";
+
+    switch(str_index(ciphers, name ? name : DEF_CIPHER)) {
+        case 0:
+            return EVP_aes_256_gcm();
+
+        case 1:
+            return EVP_chacha20_poly1305();
+
+        default:
+            return NULL;
+    }
+}
+
+aead_t *new_aead(const char *cipher, const char *key) {
+    const EVP_CIPHER *c = aead_cipher(cipher);
+    if(!c) {
+        syslog(LOG_ERR, "Unknown cipher %s", cipher);
+        return NULL;
+    }
+
+    /* Key of any length and form, e.g. a passphrase */
+    uint8_t k[SHA256_DIGEST_LENGTH];
+    SHA256((const uint8_t*)key, strlen(key), k);
+
+    /* Separate key for per-path MAC */
+    uint8_t mk[SHA256_DIGEST_LENGTH + 4];
+    memcpy(mk, k, SHA256_DIGEST_LENGTH);
+    memcpy(mk + SHA256_DIGEST_LENGTH, "path", 4);
+    SHA256(mk, sizeof(mk), mk);
+
+    aead_t *aead = calloc(1, sizeof(aead_t));
+    aead->seal_ctx = EVP_CIPHER_CTX_new();
+    aead->open_ctx = EVP_CIPHER_CTX_new();
+    aead->mac_key = EVP_PKEY_new_raw_private_key(EVP_PKEY_HMAC, NULL, mk, SHA256_DIGEST_LENGTH);
+    aead->mac_init = EVP_MD_CTX_new();
+    aead->mac_ctx = EVP_MD_CTX_new();
+
+    if(!aead->seal_ctx || !aead->open_ctx || !aead->mac_key || !aead->mac_init || !aead->mac_ctx ||
+        !EVP_EncryptInit_ex(aead->seal_ctx, c, NULL, k, NULL) ||
+        !EVP_DecryptInit_ex(aead->open_ctx, c, NULL, k, NULL) ||
+        EVP_DigestSignInit(aead->mac_init, NULL, EVP_sha256(), NULL, aead->mac_key) != 1 ||
+        RAND_bytes((uint8_t*)&aead->prefix, sizeof(aead->prefix)) != 1) {
+
+        syslog(LOG_ERR, "Can't initialize %s", cipher ? cipher : DEF_CIPHER);
+        free_aead(aead);
+        return NULL;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    aead->counter = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    aead->path_counter = aead->counter;
+
+    return aead;
+}
+
+void free_aead(aead_t *aead) {
+    if(aead->seal_ctx) EVP_CIPHER_CTX_free(aead->seal_ctx);
+    if(aead->open_ctx) EVP_CIPHER_CTX_free(aead->open_ctx);
+    if(aead->mac_init) EVP_MD_CTX_free(aead->mac_init);
+    if(aead->mac_ctx) EVP_MD_CTX_free(aead->mac_ctx);
+    if(aead->mac_key) EVP_PKEY_free(aead->mac_key);
+    free(aead);
+}
+
+static void put_be64(uint8_t *p, uint64_t v) {
+    int i;
+    for(i = 7; i >= 0; i--, v >>= 8) p[i] = v;
+}
+
+static uint64_t get_be64(const uint8_t *p) {
+    uint64_t v = 0;
+    int i;
+    for(i = 0; i < 8; i++) v = v << 8 | p[i];
+    return v;
+}
+
+/* dst must have room for length + AEAD_OVERHEAD bytes. Returns sealed length */
+ssize_t aead_seal(aead_t *aead, void *dst, const void *aad, size_t aad_len, const void *src, size_t length) {
+    uint8_t *nonce = dst;
+    uint8_t *ct = nonce + AEAD_NONCE_LEN;
+    int len;
+
+    memcpy(nonce, &aead->prefix, sizeof(aead->prefix));
+    put_be64(nonce + sizeof(aead->prefix), aead->counter++);
+
+    EVP_CIPHER_CTX *ctx = aead->seal_ctx;
+    if(X_UNLIKELY(!EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, nonce) ||
+        !EVP_EncryptUpdate(ctx, NULL, &len, aad, aad_len) ||
+        !EVP_EncryptUpdate(ctx, ct, &len, src, length) ||
+        !EVP_EncryptFinal_ex(ctx, ct + len, &len) ||
+        !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, AEAD_TAG_LEN, ct + length))) {
+
+        return -1;
+    }
+
+    return length + AEAD_OVERHEAD;
+}
+
+/* 0 if counter is new, 1 if it was accepted already, -1 if it fell behind the window */
+static int window_check(const aead_window_t *w, uint64_t counter) {
+    if(!w->top_valid || counter > w->top) return 0;
+    if(w->top - counter >= AEAD_REPLAY_WINDOW) return -1;
+
+    uint64_t bit = counter % AEAD_REPLAY_WINDOW;
+    return w->bits[bit / 64] & (1ULL << (bit % 64)) ? 1 : 0;
+}
+
+static void window_accept(aead_window_t *w, uint64_t counter) {
+    if(!w->top_valid || counter > w->top) {
+        /* Slide window, forgetting counters which fell out of it */
+        uint64_t shift = w->top_valid ? counter - w->top : AEAD_REPLAY_WINDOW;
+        if(shift >= AEAD_REPLAY_WINDOW) {
+            memset(w->bits, 0, sizeof(w->bits));
+        } else {
+            uint64_t c;
+            for(c = w->top + 1; c <= counter; c++) {
+                uint64_t bit = c % AEAD_REPLAY_WINDOW;
+                w->bits[bit / 64] &= ~(1ULL << (bit % 64));
+            }
+        }
+        w->top = counter;
+        w->top_valid = true;
+    }
+
+    uint64_t bit = counter % AEAD_REPLAY_WINDOW;
+    w->bits[bit / 64] |= 1ULL << (bit % 64);
+}
+
+/* 0 if sealed data is new, 1 if its counter was opened already, -1 if it's too old, reflected or malformed */
+int aead_check(aead_t *aead, const void *src, size_t length) {
+    if(length < AEAD_OVERHEAD) return -1;
+    if(!memcmp(src, &aead->prefix, sizeof(aead->prefix))) return -1;
+
+    return window_check(&aead->window, get_be64((const uint8_t*)src + sizeof(aead->prefix)));
+}
+
+/* Authenticate and decrypt. dst must have room for length - AEAD_OVERHEAD bytes.
+   Returns opened length or -1 if data is forged, damaged or replayed */
+ssize_t aead_open(aead_t *aead, void *dst, const void *aad, size_t aad_len, const void *src, size_t length) {
+    if(aead_check(aead, src, length) != 0) return -1;
+
+    const uint8_t *nonce = src;
+    const uint8_t *ct = nonce + AEAD_NONCE_LEN;
+    size_t ct_len = length - AEAD_OVERHEAD;
+    int len;
+
+    EVP_CIPHER_CTX *ctx = aead->open_ctx;
+    if(!EVP_DecryptInit_ex(ctx, NULL, NULL, NULL, nonce) ||
+        !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, AEAD_TAG_LEN, (void*)(ct + ct_len)) ||
+        !EVP_DecryptUpdate(ctx, NULL, &len, aad, aad_len) ||
+        !EVP_DecryptUpdate(ctx, dst, &len, ct, ct_len) ||
+        !EVP_DecryptFinal_ex(ctx, (uint8_t*)dst + len, &len)) {
+
+        return -1;
+    }
+
+    window_accept(&aead->window, get_be64(nonce + sizeof(aead->prefix)));
+
+    return ct_len;
+}
+
+/* MAC of path number, prefix and counter from trailer and given parts of datagram */
+static int aead_mac(aead_t *aead, uint8_t *mac, uint32_t path, const uint8_t *trailer, const struct iovec *iov, int iovcnt) {
+    uint8_t md[EVP_MAX_MD_SIZE];
+    uint8_t p[4] = {path >> 24, path >> 16, path >> 8, path};
+    size_t len = sizeof(md);
+    int i;
+
+    EVP_MD_CTX *ctx = aead->mac_ctx;
+    if(X_UNLIKELY(!EVP_MD_CTX_copy_ex(ctx, aead->mac_init) || !EVP_DigestSignUpdate(ctx, p, sizeof(p)) ||
+        !EVP_DigestSignUpdate(ctx, trailer, AEAD_PATH_LEN - AEAD_MAC_LEN))) {
+
+        return -1;
+    }
+    for(i = 0; i < iovcnt; i++) {
+        if(X_UNLIKELY(!EVP_DigestSignUpdate(ctx, iov[i].iov_base, iov[i].iov_len))) return -1;
+    }
+    if(X_UNLIKELY(!EVP_DigestSignFinal(ctx, md, &len))) return -1;
+
+    memcpy(mac, md, AEAD_MAC_LEN);
+    return 0;
+}
+
+/* Fill AEAD_PATH_LEN bytes of trailer authenticating given parts of datagram as sent on given path */
+int aead_sign(aead_t *aead, void *trailer, uint32_t path, const struct iovec *iov, int iovcnt) {
+    uint8_t *p = trailer;
+    memcpy(p, &aead->prefix, sizeof(aead->prefix));
+    put_be64(p + sizeof(aead->prefix), aead->path_counter++);
+    return aead_mac(aead, p + AEAD_PATH_LEN - AEAD_MAC_LEN, path, p, iov, iovcnt);
+}
+
+/* 0 if trailer authenticates given parts as received on given path, wasn't made by us
+   and its counter is new to the path's window, which then records it. -1 otherwise */
+int aead_verify(aead_t *aead, const void *trailer, uint32_t path, aead_window_t *window, const struct iovec *iov, int iovcnt) {
+    const uint8_t *p = trailer;
+    uint8_t mac[AEAD_MAC_LEN];
+
+    if(!memcmp(p, &aead->prefix, sizeof(aead->prefix))) return -1;
+
+    uint64_t counter = get_be64(p + sizeof(aead->prefix));
+    if(window_check(window, counter) != 0) return -1;
+
+    if(aead_mac(aead, mac, path, p, iov, iovcnt) < 0) return -1;
+    if(CRYPTO_memcmp(mac, p + AEAD_PATH_LEN - AEAD_MAC_LEN, AEAD_MAC_LEN)) return -1;
+
+    window_accept(window, counter);
+    return 0;
+}
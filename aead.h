@@ -0,0 +1,37 @@
+#ifndef AEAD_H
+#define AEAD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define AEAD_NONCE_LEN 12
+#define AEAD_TAG_LEN 16
+#define AEAD_OVERHEAD (AEAD_NONCE_LEN + AEAD_TAG_LEN)
+
+/* Per path trailer: sender's nonce prefix, path counter and truncated MAC */
+#define AEAD_MAC_LEN 16
+#define AEAD_PATH_LEN (4 + 8 + AEAD_MAC_LEN)
+
+/* Counters seen, enough for reordering between relays of quite different latency */
+#define AEAD_REPLAY_WINDOW 4096
+
+typedef struct _aead_t aead_t;
+
+/* Highest counter received and bitmap of recent ones */
+typedef struct {
+    bool top_valid;
+    uint64_t top;
+    uint64_t bits[AEAD_REPLAY_WINDOW / 64];
+} aead_window_t;
+
+aead_t *new_aead(const char *cipher, const char *key);
+void free_aead(aead_t *aead);
+ssize_t aead_seal(aead_t *aead, void *dst, const void *aad, size_t aad_len, const void *src, size_t length);
+int aead_check(aead_t *aead, const void *src, size_t length);
+ssize_t aead_open(aead_t *aead, void *dst, const void *aad, size_t aad_len, const void *src, size_t length);
+int aead_sign(aead_t *aead, void *trailer, uint32_t path, const struct iovec *iov, int iovcnt);
+int aead_verify(aead_t *aead, const void *trailer, uint32_t path, aead_window_t *window, const struct iovec *iov, int iovcnt);
+
+#endif
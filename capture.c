@@ -0,0 +1,364 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Eugene Zagidullin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/*
+Packet capture to pcapng file.
+
+Event loop is the only producer: it copies packet heads into a fixed ring of
+slots and never blocks, packets are dropped and counted when the ring is full.
+Writer thread is the only consumer, it does all file I/O. Control records
+(start, stop, new interface) go through the same ring, so the file always gets
+them in order with packets.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <pthread.h>
+
+#include "capture.h"
+#include "utils.h"
+#include "debug.h"
+
+/* Power of 2 */
+#define RING_SLOTS 4096
+/* Slots packets can't take, so control records and interfaces always fit */
+#define CONTROL_SLOTS 256
+#define MAX_NAME 64
+#define WRITER_SLEEP_USEC 10000
+
+enum {
+    REC_PACKET = 0,
+    REC_INTERFACE,
+    REC_START,
+    REC_STOP,
+};
+
+typedef struct {
+    uint64_t ts;        /* Wall clock, nsec */
+    uint32_t length;    /* Original length or link type */
+    uint32_t caplen;
+    uint16_t iface;
+    uint8_t type;
+    uint8_t dir;
+    uint8_t data[0];
+} slot_t;
+
+struct _capture_t {
+    char *path;
+    size_t snaplen;
+    size_t slot_size;
+    uint8_t *ring;
+
+    /* Written by producer only and by consumer only */
+    uint32_t head;
+    uint32_t tail;
+
+    bool active;
+    int interfaces;
+    unsigned long dropped;
+
+    bool stop;
+    pthread_t thread;
+
+    FILE *fp;
+};
+
+/* pcapng blocks */
+#define BT_SHB 0x0A0D0D0A
+#define BT_IDB 0x00000001
+#define BT_EPB 0x00000006
+#define OPT_END 0
+#define OPT_IF_NAME 2
+#define OPT_IF_TSRESOL 9
+#define OPT_EPB_FLAGS 2
+
+#define PAD4(x) (((x) + 3) & ~3)
+
+static uint64_t time_nsec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static slot_t *ring_slot(capture_t *cap, uint32_t idx) {
+    return (slot_t*)(cap->ring + (size_t)(idx & (RING_SLOTS - 1)) * cap->slot_size);
+}
+
+/* Producer side: free slot or NULL, packets leave CONTROL_SLOTS free for other records */
+static slot_t *ring_reserve(capture_t *cap, bool packet) {
+    uint32_t head = cap->head;
+    if(head - __atomic_load_n(&cap->tail, __ATOMIC_ACQUIRE) >= (packet ? RING_SLOTS - CONTROL_SLOTS : RING_SLOTS)) {
+        cap->dropped++;
+        return NULL;
+    }
+    return ring_slot(cap, head);
+}
+
+static void ring_commit(capture_t *cap) {
+    __atomic_store_n(&cap->head, cap->head + 1, __ATOMIC_RELEASE);
+}
+
+static void write_block(capture_t *cap, uint32_t type, const void *body, size_t length) {
+    uint32_t total = 12 + PAD4(length);
+    static const uint8_t pad[4];
+
+    fwrite(&type, 4, 1, cap->fp);
+    fwrite(&total, 4, 1, cap->fp);
+    fwrite(body, 1, length, cap->fp);
+    fwrite(pad, 1, PAD4(length) - length, cap->fp);
+    fwrite(&total, 4, 1, cap->fp);
+}
+
+static size_t put_option(uint8_t *p, uint16_t code, const void *value, uint16_t length) {
+    memcpy(p, &code, 2);
+    memcpy(p + 2, &length, 2);
+    memcpy(p + 4, value, length);
+    memset(p + 4 + length, 0, PAD4(length) - length);
+    return 4 + PAD4(length);
+}
+
+static void write_shb(capture_t *cap) {
+    uint8_t body[16];
+    uint32_t magic = 0x1A2B3C4D;
+    uint16_t major = 1, minor = 0;
+    int64_t section_len = -1;
+
+    memcpy(body, &magic, 4);
+    memcpy(body + 4, &major, 2);
+    memcpy(body + 6, &minor, 2);
+    memcpy(body + 8, &section_len, 8);
+    write_block(cap, BT_SHB, body, sizeof(body));
+}
+
+static void write_idb(capture_t *cap, const slot_t *slot) {
+    uint8_t body[8 + 4 + PAD4(MAX_NAME) + 8 + 4];
+    uint16_t linktype = slot->length, reserved = 0;
+    uint32_t snaplen = cap->snaplen;
+    uint8_t tsresol = 9; /* nsec */
+
+    memcpy(body, &linktype, 2);
+    memcpy(body + 2, &reserved, 2);
+    memcpy(body + 4, &snaplen, 4);
+
+    size_t len = 8;
+    len += put_option(body + len, OPT_IF_NAME, slot->data, slot->caplen);
+    len += put_option(body + len, OPT_IF_TSRESOL, &tsresol, 1);
+    len += put_option(body + len, OPT_END, NULL, 0);
+
+    write_block(cap, BT_IDB, body, len);
+}
+
+static void write_epb(capture_t *cap, const slot_t *slot) {
+    uint8_t body[20 + PAD4(cap->snaplen) + 8 + 4];
+    uint32_t iface = slot->iface;
+    uint32_t ts_high = slot->ts >> 32, ts_low = slot->ts;
+    uint32_t caplen = slot->caplen, length = slot->length;
+    uint32_t flags = slot->dir;
+
+    memcpy(body, &iface, 4);
+    memcpy(body + 4, &ts_high, 4);
+    memcpy(body + 8, &ts_low, 4);
+    memcpy(body + 12, &caplen, 4);
+    memcpy(body + 16, &length, 4);
+    memcpy(body + 20, slot->data, caplen);
+    memset(body + 20 + caplen, 0, PAD4(caplen) - caplen);
+
+    size_t len = 20 + PAD4(caplen);
+    len += put_option(body + len, OPT_EPB_FLAGS, &flags, 4);
+    len += put_option(body + len, OPT_END, NULL, 0);
+
+    write_block(cap, BT_EPB, body, len);
+}
+
+static void writer_open(capture_t *cap) {
+    char stamp[32];
+    time_t t = time(NULL);
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&t));
+
+    char *file = strdup_printf("%s-%s.pcapng", cap->path, stamp);
+    if((cap->fp = fopen(file, "w")) != NULL) {
+        write_shb(cap);
+        syslog(LOG_INFO, "Capturing to %s", file);
+    } else {
+        syslog(LOG_ERR, "%s: %m", file);
+    }
+    free(file);
+}
+
+static void writer_close(capture_t *cap) {
+    if(!cap->fp) return;
+    fclose(cap->fp);
+    cap->fp = NULL;
+}
+
+static void *writer_thread(void *arg) {
+    capture_t *cap = arg;
+
+    while(1) {
+        uint32_t tail = cap->tail;
+        if(tail == __atomic_load_n(&cap->head, __ATOMIC_ACQUIRE)) {
+            if(__atomic_load_n(&cap->stop, __ATOMIC_ACQUIRE)) break;
+
+            if(cap->fp) fflush(cap->fp);
+            usleep(WRITER_SLEEP_USEC);
+            continue;
+        }
+
+        slot_t *slot = ring_slot(cap, tail);
+        switch(slot->type) {
+            case REC_START:
+                writer_close(cap);
+                writer_open(cap);
+                break;
+
+            case REC_STOP:
+                writer_close(cap);
+                break;
+
+            case REC_INTERFACE:
+                if(cap->fp) write_idb(cap, slot);
+                break;
+
+            default:
+                if(cap->fp) write_epb(cap, slot);
+        }
+
+        __atomic_store_n(&cap->tail, tail + 1, __ATOMIC_RELEASE);
+    }
+
+    writer_close(cap);
+    return NULL;
+}
+
+/* Files are named path-YYYYmmdd-HHMMSS.pcapng. Nothing is allocated until capture starts */
+capture_t *new_capture(const char *path, size_t snaplen) {
+    capture_t *cap = calloc(1, sizeof(capture_t));
+    cap->path = xstrdup(path);
+    cap->snaplen = MIN(MAX(snaplen, MAX_NAME), MAX_SNAPLEN);
+    cap->slot_size = (sizeof(slot_t) + cap->snaplen + 7) & ~7;
+    return cap;
+}
+
+/* Flushes everything recorded so far */
+void free_capture(capture_t *cap) {
+    capture_stop(cap);
+    free(cap->path);
+    free(cap);
+}
+
+static void capture_control(capture_t *cap, int type) {
+    slot_t *slot = ring_reserve(cap, false);
+    if(!slot) return;
+
+    slot->type = type;
+    ring_commit(cap);
+}
+
+/* Start new file with ring and writer thread of its own, interfaces must be added again */
+int capture_start(capture_t *cap) {
+    if(cap->active) return 0;
+
+    cap->ring = malloc(RING_SLOTS * cap->slot_size);
+    if(!cap->ring) {
+        syslog(LOG_ERR, "Can't allocate capture ring of %zu bytes", RING_SLOTS * cap->slot_size);
+        return -1;
+    }
+    cap->head = cap->tail = 0;
+    cap->stop = false;
+    capture_control(cap, REC_START);
+
+    /* Writer thread is started on demand, so it's safe to fork before */
+    if(pthread_create(&cap->thread, NULL, writer_thread, cap) != 0) {
+        syslog(LOG_ERR, "Can't start capture thread");
+        free(cap->ring);
+        cap->ring = NULL;
+        return -1;
+    }
+
+    cap->active = true;
+    cap->interfaces = 0;
+    cap->dropped = 0;
+    return 0;
+}
+
+/* Waits for the writer to flush the ring, then frees it */
+void capture_stop(capture_t *cap) {
+    if(!cap->active) return;
+
+    cap->active = false;
+    capture_control(cap, REC_STOP);
+    __atomic_store_n(&cap->stop, true, __ATOMIC_RELEASE);
+    pthread_join(cap->thread, NULL);
+
+    free(cap->ring);
+    cap->ring = NULL;
+
+    if(cap->dropped) syslog(LOG_WARNING, "Capture dropped %lu packets", cap->dropped);
+}
+
+bool capture_active(capture_t *cap) {
+    return cap->active;
+}
+
+/* Returns interface id to pass to capture_packet() or -1 */
+int capture_interface(capture_t *cap, const char *name, int linktype) {
+    if(!cap->active) return -1;
+
+    slot_t *slot = ring_reserve(cap, false);
+    if(!slot) return -1;
+
+    size_t len = MIN(strlen(name), MAX_NAME);
+    slot->type = REC_INTERFACE;
+    slot->length = linktype;
+    slot->caplen = len;
+    memcpy(slot->data, name, len);
+    ring_commit(cap);
+
+    return cap->interfaces++;
+}
+
+/* Record head of packet */
+void capture_packet(capture_t *cap, int iface, int dir, const void *data, size_t length) {
+    if(!cap->active || iface < 0) return;
+
+    slot_t *slot = ring_reserve(cap, true);
+    if(!slot) return;
+
+    slot->type = REC_PACKET;
+    slot->ts = time_nsec();
+    slot->iface = iface;
+    slot->dir = dir;
+    slot->length = length;
+    slot->caplen = MIN(length, cap->snaplen);
+    memcpy(slot->data, data, slot->caplen);
+    ring_commit(cap);
+}
+
+unsigned long capture_dropped(capture_t *cap) {
+    return cap->dropped;
+}
@@ -0,0 +1,32 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* pcapng link types */
+#define LINKTYPE_RAW 101     /* IP packets */
+#define LINKTYPE_USER0 147   /* Relayed datagrams with udprelayd header */
+#define LINKTYPE_USER1 148   /* Datagrams of outward UDP socket */
+
+/* Largest datagram, bounds ring slots and block buffers */
+#define MAX_SNAPLEN 65535
+
+enum {
+    CAPTURE_IN = 1,
+    CAPTURE_OUT = 2,
+};
+
+typedef struct _capture_t capture_t;
+
+capture_t *new_capture(const char *path, size_t snaplen);
+void free_capture(capture_t *cap);
+int capture_start(capture_t *cap);
+void capture_stop(capture_t *cap);
+bool capture_active(capture_t *cap);
+int capture_interface(capture_t *cap, const char *name, int linktype);
+void capture_packet(capture_t *cap, int iface, int dir, const void *data, size_t length);
+unsigned long capture_dropped(capture_t *cap);
+
+#endif
@@ -0,0 +1,192 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Eugene Zagidullin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/*
+Delay based congestion controller in the spirit of LEDBAT (RFC 6817), but rate based.
+Receiver estimates one-way queuing delay as difference between current delay and base
+(minimal) delay, counts lost datagrams using per-path sequence numbers and reports back
+every CC_INTERVAL. Sender adjusts its rate proportionally to the distance from target
+queuing delay and halves it on loss.
+*/
+
+#include <string.h>
+
+#include "cc.h"
+#include "utils.h"
+#include "debug.h"
+
+#define CC_INTERVAL 50000       /* Feedback interval, usec */
+#define CC_TIMEOUT 1000000      /* No feedback for this long is treated as loss */
+#define CC_BASE_PERIOD 60000000 /* Base delay history bucket length */
+#define CC_MIN_RATE 8000        /* 64 kbit/s */
+#define CC_INIT_RATE 125000     /* 1 Mbit/s */
+#define CC_MAX_RATE 125000000   /* 1 Gbit/s */
+#define CC_GAIN 0.25
+
+void cc_init(cc_t *cc, uint64_t max_rate, uint32_t target) {
+    memset(cc, 0, sizeof(cc_t));
+    if(!target) return;
+
+    cc->target = target;
+    cc->max_rate = max_rate ? max_rate : CC_MAX_RATE;
+    cc->rate = MIN(CC_INIT_RATE, cc->max_rate);
+    cc->report_time = cc->send_time = cc->decrease_time = time_usec();
+}
+
+void cc_limit(cc_t *cc, uint64_t max_rate) {
+    if(!cc->rate) return;
+
+    cc->max_rate = max_rate ? max_rate : CC_MAX_RATE;
+    cc->rate = MIN(cc->rate, cc->max_rate);
+}
+
+/* Signed distance between two wrapping 32-bit timestamps */
+static int32_t ts_diff(uint32_t a, uint32_t b) {
+    return (int32_t)(a - b);
+}
+
+static uint32_t cc_base(cc_t *cc) {
+    uint32_t base = cc->base[0];
+    int i;
+    for(i = 1; i < CC_BASE_HISTORY; i++) {
+        if(ts_diff(cc->base[i], base) < 0) base = cc->base[i];
+    }
+    return base;
+}
+
+/* Account datagram received on path. ts is sender's clock, usec */
+void cc_received(cc_t *cc, uint16_t pseq, uint32_t ts, size_t length, uint64_t now) {
+    /* Clock offset between nodes is unknown but constant, it cancels out in queuing delay */
+    uint32_t delay = (uint32_t)now - ts;
+
+    if(!cc->base_valid) {
+        int i;
+        for(i = 0; i < CC_BASE_HISTORY; i++) cc->base[i] = delay;
+        cc->base_time = now;
+        cc->base_valid = true;
+    } else if(now - cc->base_time >= CC_BASE_PERIOD) {
+        /* Forget oldest minute so the base follows route changes */
+        cc->base_idx = (cc->base_idx + 1) % CC_BASE_HISTORY;
+        cc->base[cc->base_idx] = delay;
+        cc->base_time = now;
+    } else if(ts_diff(delay, cc->base[cc->base_idx]) < 0) {
+        cc->base[cc->base_idx] = delay;
+    }
+
+    /* Minimal delay over interval filters out jitter */
+    if(!cc->delay_valid || ts_diff(delay, cc->delay) < 0) {
+        cc->delay = delay;
+        cc->delay_valid = true;
+    }
+
+    if(cc->pseq_valid) {
+        int16_t gap = (int16_t)(pseq - cc->next_pseq);
+        if(gap < 0) {
+            /* Reordered, was counted as lost */
+            if(cc->lost) cc->lost--;
+        } else {
+            cc->lost += gap;
+            cc->next_pseq = pseq + 1;
+        }
+    } else {
+        cc->next_pseq = pseq + 1;
+        cc->pseq_valid = true;
+    }
+
+    if(!cc->interval_start) cc->interval_start = now;
+    cc->bytes += length;
+    cc->received++;
+}
+
+/* Returns true and fills report if it is time to send feedback */
+bool cc_report(cc_t *cc, uint64_t now, cc_report_t *report) {
+    if(!cc->interval_start || now - cc->interval_start < CC_INTERVAL) return false;
+
+    int32_t qdelay = ts_diff(cc->delay, cc_base(cc));
+
+    report->qdelay = qdelay > 0 ? qdelay : 0;
+    report->bytes = cc->bytes;
+    report->interval = now - cc->interval_start;
+    report->received = cc->received;
+    report->lost = cc->lost;
+
+    cc->interval_start = now;
+    cc->delay_valid = false;
+    cc->bytes = 0;
+    cc->received = 0;
+    cc->lost = 0;
+
+    return true;
+}
+
+static void cc_decrease(cc_t *cc, uint64_t now) {
+    /* React to loss at most once per two feedback intervals */
+    if(now - cc->decrease_time < 2 * CC_INTERVAL) return;
+
+    cc->rate = MAX(cc->rate / 2, CC_MIN_RATE);
+    cc->decrease_time = now;
+}
+
+/* Process feedback from the receiver, returns new rate */
+uint64_t cc_update(cc_t *cc, const cc_report_t *report, uint64_t now) {
+    if(!cc->rate) return 0;
+
+    cc->report_time = now;
+
+    if(report->lost) {
+        cc_decrease(cc, now);
+        X_DBG("loss %u of %u, rate %lu\n", report->lost, report->received + report->lost, (unsigned long)cc->rate);
+        return cc->rate;
+    }
+
+    double off_target = ((double)cc->target - report->qdelay) / cc->target;
+    if(off_target < -1) off_target = -1;
+
+    if(off_target > 0 && report->interval) {
+        /* Don't grow beyond what is actually used */
+        uint64_t delivered = (uint64_t)report->bytes * 1000000 / report->interval;
+        if(cc->rate > 2 * delivered) return cc->rate;
+    }
+
+    double rate = cc->rate * (1 + CC_GAIN * off_target);
+    cc->rate = MIN(MAX((uint64_t)rate, CC_MIN_RATE), cc->max_rate);
+
+    X_DBG("qdelay %u, rate %lu\n", report->qdelay, (unsigned long)cc->rate);
+    return cc->rate;
+}
+
+/* Called while sending, slows down if the receiver went silent. Returns new rate */
+uint64_t cc_check(cc_t *cc, uint64_t now) {
+    if(!cc->rate) return 0;
+
+    /* Silence after idle period is expected */
+    if(now - cc->send_time >= CC_TIMEOUT) cc->report_time = now;
+    cc->send_time = now;
+
+    if(now - cc->report_time >= CC_TIMEOUT) {
+        cc->report_time = now;
+        cc_decrease(cc, now);
+    }
+    return cc->rate;
+}
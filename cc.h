@@ -0,0 +1,57 @@
+#ifndef CC_H
+#define CC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Number of one-minute buckets used to track base delay */
+#define CC_BASE_HISTORY 10
+
+typedef struct _cc_t cc_t;
+typedef struct _cc_report_t cc_report_t;
+
+/* Receiver's summary of one feedback interval */
+struct _cc_report_t {
+    uint32_t qdelay;    /* Queuing delay estimate, usec */
+    uint32_t bytes;     /* Bytes received during interval */
+    uint32_t interval;  /* Interval length, usec */
+    uint16_t received;
+    uint16_t lost;
+};
+
+struct _cc_t {
+    /* Sender side. Rate is in bytes per second, 0 means disabled */
+    uint64_t rate;
+    uint64_t max_rate;
+    uint32_t target;
+    uint64_t report_time;
+    uint64_t send_time;
+    uint64_t decrease_time;
+
+    /* Receiver side */
+    bool pseq_valid;
+    uint16_t next_pseq;
+
+    bool base_valid;
+    uint32_t base[CC_BASE_HISTORY];
+    int base_idx;
+    uint64_t base_time;
+
+    bool delay_valid;
+    uint32_t delay;
+
+    uint64_t interval_start;
+    uint32_t bytes;
+    uint16_t received;
+    uint16_t lost;
+};
+
+void cc_init(cc_t *cc, uint64_t max_rate, uint32_t target);
+void cc_limit(cc_t *cc, uint64_t max_rate);
+void cc_received(cc_t *cc, uint16_t pseq, uint32_t ts, size_t length, uint64_t now);
+bool cc_report(cc_t *cc, uint64_t now, cc_report_t *report);
+uint64_t cc_update(cc_t *cc, const cc_report_t *report, uint64_t now);
+uint64_t cc_check(cc_t *cc, uint64_t now);
+
+#endif
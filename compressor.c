@@ -0,0 +1,222 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Eugene Zagidullin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/*
+Stateless per-datagram compression: raw deflate, optionally primed with a
+preset dictionary shared by both nodes. Every datagram is compressed on its
+own, so losses and reordering don't matter.
+
+Loading the dictionary hashes all of it, which would cost more than the
+compression of a small datagram. It's loaded into a primed stream once and
+its state is copied for every datagram instead. The copy takes memory from
+an arena sized on setup, so it's a plain memcpy without allocations.
+
+Incompressible traffic (already encrypted or compressed) is detected by
+results: after every failure compression is skipped for twice as many
+datagrams as before, up to MAX_BACKOFF.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <syslog.h>
+#include <zlib.h>
+
+#include "compressor.h"
+#include "utils.h"
+#include "debug.h"
+
+/* Max dictionary size deflate can use */
+#define DICT_SZ 32768
+
+/* Datagrams not worth compressing */
+#define MIN_LENGTH 64
+
+#define MAX_BACKOFF 256
+
+struct _compressor_t {
+    int level;
+    z_stream deflate;
+    z_stream inflate;
+
+    /* Stream with dictionary loaded, deflate is its copy in arena when there is a dictionary */
+    z_stream primed;
+    uint8_t *arena;
+    size_t arena_size;
+    size_t arena_used;
+    bool measure;
+
+    uint8_t *dict;
+    size_t dict_len;
+
+    /* Adaptive skipping */
+    int skip;
+    int backoff;
+};
+
+static int load_dict(compressor_t *c, const char *dict_file) {
+    FILE *fp = fopen(dict_file, "r");
+    if(!fp) return -1;
+
+    /* Deflate only looks at the last 32KB */
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    if(size > DICT_SZ) fseek(fp, size - DICT_SZ, SEEK_SET);
+    else rewind(fp);
+
+    c->dict = malloc(DICT_SZ);
+    c->dict_len = fread(c->dict, 1, DICT_SZ, fp);
+    fclose(fp);
+
+    return 0;
+}
+
+/* zlib allocator of primed stream and its copies: heap until the arena exists, then arena */
+static voidpf arena_alloc(voidpf opaque, uInt items, uInt size) {
+    compressor_t *c = opaque;
+    size_t n = ((size_t)items * size + 15) & ~(size_t)15;
+
+    if(c->measure) c->arena_size += n;
+    if(!c->arena) return calloc(items, size);
+
+    if(c->arena_used + n > c->arena_size) return Z_NULL;
+    void *p = c->arena + c->arena_used;
+    c->arena_used += n;
+    return p;
+}
+
+static void arena_free(voidpf opaque, voidpf p) {
+    compressor_t *c = opaque;
+    if(c->arena && (uint8_t*)p >= c->arena && (uint8_t*)p < c->arena + c->arena_size) return;
+    free(p);
+}
+
+/* Load dictionary once and size the arena by a trial copy */
+static int prime(compressor_t *c) {
+    c->primed.zalloc = arena_alloc;
+    c->primed.zfree = arena_free;
+    c->primed.opaque = c;
+
+    if(deflateInit2(&c->primed, c->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK ||
+        deflateSetDictionary(&c->primed, c->dict, c->dict_len) != Z_OK) return -1;
+
+    c->measure = true;
+    int ret = deflateCopy(&c->deflate, &c->primed);
+    c->measure = false;
+    if(ret != Z_OK) return -1;
+    deflateEnd(&c->deflate);
+
+    return (c->arena = malloc(c->arena_size)) ? 0 : -1;
+}
+
+/* Fresh stream for next datagram */
+static int compressor_reset(compressor_t *c) {
+    if(!c->arena) return deflateReset(&c->deflate);
+
+    c->arena_used = 0;
+    return deflateCopy(&c->deflate, &c->primed);
+}
+
+/* Level 0 only decompresses */
+compressor_t *new_compressor(int level, const char *dict_file) {
+    compressor_t *c = calloc(1, sizeof(compressor_t));
+    c->level = level;
+
+    if(dict_file && load_dict(c, dict_file) < 0) {
+        syslog(LOG_ERR, "%s: %m", dict_file);
+        free_compressor(c);
+        return NULL;
+    }
+
+    /* Negative window bits: raw deflate without zlib header and checksum */
+    bool ok = inflateInit2(&c->inflate, -15) == Z_OK;
+    if(ok && level) ok = c->dict ? prime(c) == 0 : deflateInit2(&c->deflate, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+
+    if(!ok) {
+        syslog(LOG_ERR, "Can't initialize zlib");
+        free_compressor(c);
+        return NULL;
+    }
+
+    return c;
+}
+
+void free_compressor(compressor_t *c) {
+    /* Copy of primed stream lives in arena */
+    if(c->primed.state) deflateEnd(&c->primed);
+    if(c->arena) free(c->arena);
+    else if(c->deflate.state) deflateEnd(&c->deflate);
+    if(c->inflate.state) inflateEnd(&c->inflate);
+    if(c->dict) free(c->dict);
+    free(c);
+}
+
+/* Compress into dst (at least length bytes). Returns compressed length
+   or 0 if it's disabled, skipped or doesn't pay off */
+size_t compressor_pack(compressor_t *c, void *dst, const void *src, size_t length) {
+    if(!c->level || length < MIN_LENGTH) return 0;
+
+    if(c->skip) {
+        c->skip--;
+        return 0;
+    }
+
+    z_stream *z = &c->deflate;
+    if(X_UNLIKELY(compressor_reset(c) != Z_OK)) return 0;
+
+    /* Must save at least 1/16 to be worth it */
+    size_t limit = length - length / 16;
+
+    z->next_in = (Bytef*)src;
+    z->avail_in = length;
+    z->next_out = dst;
+    z->avail_out = limit;
+
+    if(deflate(z, Z_FINISH) != Z_STREAM_END) {
+        c->backoff = c->backoff ? MIN(c->backoff * 2, MAX_BACKOFF) : 1;
+        c->skip = c->backoff;
+        X_DBG("Incompressible, skip %d\n", c->skip);
+        return 0;
+    }
+
+    c->backoff = 0;
+    return limit - z->avail_out;
+}
+
+/* Returns decompressed length or -1 */
+ssize_t compressor_unpack(compressor_t *c, void *dst, size_t dst_size, const void *src, size_t length) {
+    z_stream *z = &c->inflate;
+    inflateReset(z);
+    if(c->dict) inflateSetDictionary(z, c->dict, c->dict_len);
+
+    z->next_in = (Bytef*)src;
+    z->avail_in = length;
+    z->next_out = dst;
+    z->avail_out = dst_size;
+
+    if(inflate(z, Z_FINISH) != Z_STREAM_END) return -1;
+    return dst_size - z->avail_out;
+}
@@ -0,0 +1,14 @@
+#ifndef COMPRESSOR_H
+#define COMPRESSOR_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+typedef struct _compressor_t compressor_t;
+
+compressor_t *new_compressor(int level, const char *dict_file);
+void free_compressor(compressor_t *c);
+size_t compressor_pack(compressor_t *c, void *dst, const void *src, size_t length);
+ssize_t compressor_unpack(compressor_t *c, void *dst, size_t dst_size, const void *src, size_t length);
+
+#endif
@@ -25,12 +25,21 @@ SOFTWARE.
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdbool.h>
+#include <limits.h>
 
 #include "utils.h"
 #include "config.h"
+#include "capture.h"
 
 #define READBUF_SZ 4096
 #define DEF_TRACK 1024
+#define DEF_MTU 1400
+#define DEF_REASSEMBLY 16
+#define DEF_RESOLVE 300
+#define DEF_COPIES 2
+#define DEF_SNAPLEN 256
+#define DEF_WEIGHT 1
 
 typedef enum {
     OPT_LISTEN = 0,
@@ -39,10 +48,70 @@ typedef enum {
     OPT_LOCAL,
     OPT_REMOTE,
     OPT_TRACK,
+    OPT_RATE,
+    OPT_BURST,
+    OPT_QUEUE,
+    OPT_CONGESTION,
+    OPT_MTU,
+    OPT_BUNDLE,
+    OPT_REASSEMBLY,
+    OPT_RESOLVE,
+    OPT_DEVICE,
+    OPT_FWMARK,
+    OPT_TOS,
+    OPT_DSCP,
+    OPT_MODE,
+    OPT_COPIES,
+    OPT_WEIGHT,
+    OPT_KEY,
+    OPT_CIPHER,
+    OPT_COMPRESS,
+    OPT_DICTIONARY,
+    OPT_TUN,
+    OPT_CAPTURE,
+    OPT_SNAPLEN,
+    OPT_SKEW,
+    OPT_BUSY_POLL,
+    OPT_CPU,
+    OPT_SCHED,
+    OPT_MLOCK,
+    OPT_RCVBUF,
+    OPT_SNDBUF,
+    OPT_OFFSET,
+    OPT_TXTIME,
+    OPT_KERNEL_DEDUP,
+    OPT_PATH,
 } opt_t;
 
+/* Options allowed only inside relay statement */
+static bool relay_opt(int opt) {
+    switch(opt) {
+        case OPT_LOCAL:
+        case OPT_REMOTE:
+        case OPT_RATE:
+        case OPT_BURST:
+        case OPT_QUEUE:
+        case OPT_DEVICE:
+        case OPT_FWMARK:
+        case OPT_TOS:
+        case OPT_DSCP:
+        case OPT_WEIGHT:
+        case OPT_RCVBUF:
+        case OPT_SNDBUF:
+        case OPT_OFFSET:
+        case OPT_TXTIME:
+        case OPT_PATH:
+            return true;
+
+        default:
+            return false;
+    }
+}
+
 config_t *parse_config(const char *file) {
-    static const char *lexemes = "listen\0forward\0relay\0local\0remote\0track\0";
+    static const char *lexemes = "listen\0forward\0relay\0local\0remote\0track\0rate\0burst\0queue\0congestion\0mtu\0bundle\0reassembly\0resolve\0device\0fwmark\0tos\0dscp\0mode\0copies\0weight\0key\0cipher\0compress\0dictionary\0tun\0capture\0snaplen\0skew\0busy_poll\0cpu\0sched\0mlock\0rcvbuf\0sndbuf\0offset\0txtime\0kernel_dedup\0path\0";
+    static const char *modes = "broadcast\0backup\0weighted\0kofn\0";
+    static const char *txtimes = "queue\0etf\0fq\0";
     static const char *delim = " \t\n";
 
     FILE *fp;
@@ -50,6 +119,13 @@ config_t *parse_config(const char *file) {
 
     config_t *conf = calloc(1, sizeof(config_t));
     conf->track = DEF_TRACK;
+    conf->mtu = DEF_MTU;
+    conf->reassembly = DEF_REASSEMBLY;
+    conf->resolve = DEF_RESOLVE;
+    conf->copies = DEF_COPIES;
+    conf->snaplen = DEF_SNAPLEN;
+    bool error = false;
+    int relays = 0;
 
     char buf[READBUF_SZ];
     while(fgets(buf, sizeof(buf), fp)) {
@@ -61,32 +137,97 @@ config_t *parse_config(const char *file) {
         if(!param) continue;
 
         int opt = str_index(lexemes, param);
-        if(opt < 0 || opt == OPT_LOCAL || opt == OPT_REMOTE) continue;
+        if(opt < 0 || relay_opt(opt)) continue;
 
         if(opt == OPT_RELAY) {
             relay_config_t *relay_conf = calloc(1, sizeof(relay_config_t));
+            relay_conf->weight = DEF_WEIGHT;
+            relay_conf->path = -1;
 
             char *arg_str;
             while((arg_str = strtok_r(NULL, delim, &last)) != NULL) {
                 int arg = str_index(lexemes, arg_str);
-                if(arg != OPT_LOCAL && arg != OPT_REMOTE) continue;
+                if(arg < 0 || !relay_opt(arg)) continue;
+
+                char *val = strtok_r(NULL, delim, &last);
+                if(!val) break;
+
+                switch(arg) {
+                    case OPT_LOCAL:
+                        strreplace(&relay_conf->local_addr, val);
+                        break;
+
+                    case OPT_REMOTE:
+                        strreplace(&relay_conf->remote_addr, val);
+                        break;
+
+                    case OPT_RATE:
+                        relay_conf->rate = strtosize(val);
+                        break;
+
+                    case OPT_BURST:
+                        relay_conf->burst = strtosize(val);
+                        break;
+
+                    case OPT_QUEUE:
+                        relay_conf->queue = strtol(val, NULL, 0);
+                        break;
+
+                    case OPT_DEVICE:
+                        strreplace(&relay_conf->device, val);
+                        break;
+
+                    case OPT_FWMARK:
+                        relay_conf->fwmark = strtoul(val, NULL, 0);
+                        break;
+
+                    case OPT_TOS:
+                        relay_conf->tos = strtol(val, NULL, 0) & 0xff;
+                        break;
+
+                    case OPT_DSCP:
+                        /* DSCP is upper 6 bits of TOS byte */
+                        relay_conf->tos = (strtol(val, NULL, 0) & 0x3f) << 2;
+                        break;
+
+                    case OPT_WEIGHT:
+                        relay_conf->weight = MAX(strtol(val, NULL, 0), 1);
+                        break;
+
+                    case OPT_RCVBUF:
+                        relay_conf->rcvbuf = MIN(strtosize(val), INT_MAX / 2);
+                        break;
 
-                char *addr = strtok_r(NULL, delim, &last);
-                if(!addr) break;
+                    case OPT_SNDBUF:
+                        relay_conf->sndbuf = MIN(strtosize(val), INT_MAX / 2);
+                        break;
 
-                if(arg == OPT_LOCAL) {
-                    strreplace(&relay_conf->local_addr, addr);
-                } else {
-                    strreplace(&relay_conf->remote_addr, addr);
+                    case OPT_OFFSET:
+                        relay_conf->offset = MAX(strtol(val, NULL, 0), 0);
+                        break;
+
+                    case OPT_PATH:
+                        relay_conf->path = MAX(strtol(val, NULL, 0), 0);
+                        break;
+
+                    case OPT_TXTIME: {
+                        int txtime = str_index(txtimes, val);
+                        if(txtime < 0) {
+                            error = true;
+                        } else {
+                            relay_conf->txtime = txtime;
+                        }
+                        break;
+                    }
                 }
             }
 
             if(relay_conf->local_addr && relay_conf->remote_addr) {
+                if(relay_conf->path < 0) relay_conf->path = relays;
+                relays++;
                 CLIST_ADD_LAST(conf->relay_config, relay_conf);
             } else {
-                if(relay_conf->local_addr) free(relay_conf->local_addr);
-                if(relay_conf->remote_addr) free(relay_conf->remote_addr);
-                free(relay_conf);
+                free_relay_config(relay_conf);
             }
         } else {
             char *arg = strtok_r(NULL, delim, &last);
@@ -103,13 +244,101 @@ config_t *parse_config(const char *file) {
 
                 case OPT_TRACK:
                     conf->track = strtol(arg, NULL, 0);
+                    break;
+
+                case OPT_CONGESTION:
+                    conf->congestion = strtol(arg, NULL, 0);
+                    break;
+
+                case OPT_MTU:
+                    /* Header, encryption overhead and some payload must fit, 0 = no limit */
+                    conf->mtu = strtol(arg, NULL, 0);
+                    if(conf->mtu && conf->mtu < MIN_MTU) error = true;
+                    break;
+
+                case OPT_BUNDLE:
+                    conf->bundle = strtol(arg, NULL, 0);
+                    break;
+
+                case OPT_REASSEMBLY:
+                    conf->reassembly = strtol(arg, NULL, 0);
+                    break;
+
+                case OPT_RESOLVE:
+                    conf->resolve = strtol(arg, NULL, 0);
+                    break;
+
+                case OPT_MODE: {
+                    int mode = str_index(modes, arg);
+                    if(mode < 0) {
+                        error = true;
+                    } else {
+                        conf->mode = mode;
+                    }
+                    break;
+                }
+
+                case OPT_COPIES:
+                    conf->copies = MAX(strtol(arg, NULL, 0), 1);
+                    break;
+
+                case OPT_KEY:
+                    strreplace(&conf->key, arg);
+                    break;
+
+                case OPT_CIPHER:
+                    strreplace(&conf->cipher, arg);
+                    break;
+
+                case OPT_COMPRESS:
+                    conf->compress = MIN(MAX(strtol(arg, NULL, 0), 0), 9);
+                    break;
+
+                case OPT_DICTIONARY:
+                    strreplace(&conf->dictionary, arg);
+                    break;
+
+                case OPT_TUN:
+                    strreplace(&conf->tun, arg);
+                    break;
+
+                case OPT_CAPTURE:
+                    strreplace(&conf->capture, arg);
+                    break;
+
+                case OPT_SNAPLEN:
+                    conf->snaplen = MIN(MAX(strtol(arg, NULL, 0), 0), MAX_SNAPLEN);
+                    break;
+
+                case OPT_SKEW:
+                    conf->skew = MAX(strtol(arg, NULL, 0), 0);
+                    break;
+
+                case OPT_BUSY_POLL:
+                    conf->busy_poll = MAX(strtol(arg, NULL, 0), 0);
+                    break;
+
+                case OPT_CPU:
+                    strreplace(&conf->cpu, arg);
+                    break;
+
+                case OPT_SCHED:
+                    strreplace(&conf->sched, arg);
+                    break;
+
+                case OPT_MLOCK:
+                    conf->mlock = strtol(arg, NULL, 0);
+                    break;
+
+                case OPT_KERNEL_DEDUP:
+                    conf->kernel_dedup = strtol(arg, NULL, 0);
             }
         }
     }
 
     fclose(fp);
 
-    if((!conf->outward.local_addr && !conf->outward.remote_addr) || !conf->relay_config) {
+    if(error || (!conf->outward.local_addr && !conf->outward.remote_addr && !conf->tun) || !conf->relay_config) {
         /* Missing critical parameters */
         free_config(conf);
         return NULL;
@@ -118,17 +347,28 @@ config_t *parse_config(const char *file) {
     return conf;
 }
 
+void free_relay_config(relay_config_t *config) {
+    if(config->local_addr) free(config->local_addr);
+    if(config->remote_addr) free(config->remote_addr);
+    if(config->device) free(config->device);
+    free(config);
+}
+
 void free_config(config_t *config) {
     relay_config_t *r;
     while((r = config->relay_config) != NULL) {
         CLIST_DEL(config->relay_config, r);
-        
-        if(r->local_addr) free(r->local_addr);
-        if(r->remote_addr) free(r->remote_addr);
-        free(r);
+        free_relay_config(r);
     }
     if(config->outward.local_addr) free(config->outward.local_addr);
     if(config->outward.remote_addr) free(config->outward.remote_addr);
+    if(config->key) free(config->key);
+    if(config->cipher) free(config->cipher);
+    if(config->dictionary) free(config->dictionary);
+    if(config->tun) free(config->tun);
+    if(config->capture) free(config->capture);
+    if(config->cpu) free(config->cpu);
+    if(config->sched) free(config->sched);
 
     free(config);
 }
\ No newline at end of file
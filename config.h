@@ -1,13 +1,54 @@
 #ifndef CONFIG_H
 #define CONFIG_H
 
+#include <stdint.h>
+#include <stddef.h>
+
 #include "clist.h"
 
+/* How datagrams are scheduled over relays */
+typedef enum {
+	MODE_BROADCAST = 0,	/* Copy to every relay */
+	MODE_BACKUP,		/* Only to the best relay, others are standby */
+	MODE_WEIGHTED,		/* Each datagram to one relay, in proportion to weights */
+	MODE_KOFN,		/* Copy to k best relays */
+} relay_mode_t;
+
+/* What delays copies by relay offset */
+typedef enum {
+	TXTIME_QUEUE = 0,	/* Held in send queue */
+	TXTIME_ETF,		/* SO_TXTIME in CLOCK_TAI for etf qdisc */
+	TXTIME_FQ,		/* SO_TXTIME in CLOCK_MONOTONIC for fq qdisc */
+} txtime_t;
+
+/* Smallest datagram fitting IPv4 minimal MTU */
+#define MIN_MTU (576 - 20 - 8)
+
 typedef struct _relay_config_t relay_config_t;
 struct _relay_config_t {
 	char *local_addr;
 	char *remote_addr;
 
+	/* Pacing: rate in bits per second (0 = unlimited), bucket depth in bytes */
+	uint64_t rate;
+	size_t burst;
+	/* Max number of datagrams waiting in send queue (0 = unlimited) */
+	int queue;
+	/* Pin to network interface, mark for policy routing, IP TOS byte (0 = not set) */
+	char *device;
+	uint32_t fwmark;
+	int tos;
+	/* Share of traffic in weighted mode, preference in backup and k-of-n modes */
+	int weight;
+	/* Socket buffer sizes in bytes (0 = system default) */
+	int rcvbuf;
+	int sndbuf;
+	/* Send copies N usec later than they are due and what delays them */
+	int offset;
+	txtime_t txtime;
+	/* Number binding per-path MAC to this relay, same on both nodes (default is position in config) */
+	int path;
+
 	relay_config_t *_prev;
 	relay_config_t *_next;
 };
@@ -15,11 +56,48 @@ struct _relay_config_t {
 typedef struct _config_t config_t;
 struct _config_t {
 	relay_config_t outward;
+	/* TUN device used as outward interface instead of listen/forward socket */
+	char *tun;
 	relay_config_t *relay_config;
 	int track;
+	/* Keep sequence numbers for at least N ms, max difference of path delays (0 = count only) */
+	int skew;
+	/* Target queuing delay for congestion control, ms (0 = disabled) */
+	int congestion;
+	/* Max size of relayed datagram */
+	int mtu;
+	/* Bundle small datagrams waiting at most N usec (0 = disabled) */
+	int bundle;
+	/* Number of datagrams being reassembled at once */
+	int reassembly;
+	/* Re-resolve remote host names every N seconds (0 = only when relay is reopened) */
+	int resolve;
+	relay_mode_t mode;
+	/* Number of copies in k-of-n mode */
+	int copies;
+	/* Pre-shared key for authenticated encryption (NULL = disabled) and cipher name */
+	char *key;
+	char *cipher;
+	/* Deflate level (0 = disabled) and preset dictionary file */
+	int compress;
+	char *dictionary;
+	/* Capture file prefix (capture toggled by SIGUSR1) and bytes kept per packet */
+	char *capture;
+	int snaplen;
+	/* Spin on sockets for up to N usec before sleeping (0 = disabled) */
+	int busy_poll;
+	/* CPUs to run event loop on, list like 0,2-3 (NULL = any) */
+	char *cpu;
+	/* Scheduling policy of event loop with optional priority, like fifo:50 (NULL = default) */
+	char *sched;
+	/* Lock memory and pre-fault stack */
+	int mlock;
+	/* Drop copies of forwarded datagrams in kernel by eBPF socket filter */
+	int kernel_dedup;
 };
 
 config_t *parse_config(const char *file);
 void free_config(config_t *config);
+void free_relay_config(relay_config_t *config);
 
 #endif
\ No newline at end of file
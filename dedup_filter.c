@@ -0,0 +1,235 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Eugene Zagidullin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/*
+Early drop of duplicates by eBPF socket filter.
+
+The filter attached to relay sockets looks sequence number of every data
+datagram up in a bitmap of 65536 bits and drops the datagram before it is
+queued to the socket if the bit is set. The bitmap lives in a memory mapped
+BPF array map and is written only here, one bit for every datagram forwarded,
+so it never holds anything udprelayd has not accepted itself: forged and not
+yet authenticated datagrams can't get other ones dropped, and copies racing
+with the first one are just left to seen_lookup.
+
+Bits are cleared in the order they were set, keeping at most size of them.
+With size not exceeding the one of seen_lookup the filter drops only what
+lookup_push would drop too, so peer restarts and wrapping of sequence numbers
+are handled there.
+
+The last word of the map counts dropped datagrams.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+
+#include "dedup_filter.h"
+
+#define SEQ_SPACE 65536
+#define WORDS (SEQ_SPACE / 64)
+#define COUNTER WORDS
+
+/* Socket filter sees UDP header in front of payload */
+#define UDP_HDR 8
+
+struct _dedup_filter_t {
+    int map_fd;
+    int prog_fd;
+
+    /* Mapped map values, WORDS bitmap words followed by counter */
+    uint64_t *words;
+    size_t map_len;
+
+    /* Marked sequence numbers, oldest first */
+    uint16_t *ring;
+    int size;
+    int head;
+    int count;
+};
+
+#define INSN(CODE, DST, SRC, OFF, IMM) \
+    ((struct bpf_insn){.code = (CODE), .dst_reg = (DST), .src_reg = (SRC), .off = (OFF), .imm = (IMM)})
+
+static int sys_bpf(int cmd, union bpf_attr *attr) {
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static int dedup_filter_load(dedup_filter_t *df, const dedup_header_t *hdr) {
+    /* Jump offsets are relative to the next instruction */
+    enum { DROP = 29, PASS = 31 };
+    struct bpf_insn prog[] = {
+        /* Legacy packet loads need context in r6 and return value in host byte order */
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0),
+        INSN(BPF_LD | BPF_ABS | BPF_B, 0, 0, 0, UDP_HDR + hdr->flags),
+        INSN(BPF_JMP | BPF_JSET | BPF_K, BPF_REG_0, 0, PASS - 3, hdr->keep),
+        INSN(BPF_LD | BPF_ABS | BPF_B, 0, 0, 0, UDP_HDR + hdr->type),
+        INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_0, 0, PASS - 5, hdr->data),
+        INSN(BPF_LD | BPF_ABS | BPF_H, 0, 0, 0, UDP_HDR + hdr->seq),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_7, BPF_REG_0, 0, 0),
+
+        /* r0 = words[seq / 64] */
+        INSN(BPF_ALU64 | BPF_RSH | BPF_K, BPF_REG_0, 0, 0, 6),
+        INSN(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_0, -4, 0),
+        INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, df->map_fd),
+        INSN(0, 0, 0, 0, 0),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0),
+        INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -4),
+        INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem),
+        INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, PASS - 15, 0),
+        INSN(BPF_LDX | BPF_MEM | BPF_DW, BPF_REG_1, BPF_REG_0, 0, 0),
+
+        /* Pass if bit seq % 64 is clear */
+        INSN(BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_7, 0, 0, 63),
+        INSN(BPF_ALU64 | BPF_RSH | BPF_X, BPF_REG_1, BPF_REG_7, 0, 0),
+        INSN(BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_1, 0, 0, 1),
+        INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_1, 0, PASS - 20, 0),
+
+        /* Count and drop */
+        INSN(BPF_ST | BPF_MEM | BPF_W, BPF_REG_10, 0, -4, COUNTER),
+        INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, df->map_fd),
+        INSN(0, 0, 0, 0, 0),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0),
+        INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -4),
+        INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem),
+        INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, DROP - 27, 0),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_1, 0, 0, 1),
+        INSN(BPF_STX | BPF_XADD | BPF_DW, BPF_REG_0, BPF_REG_1, 0, 0),
+
+        /* DROP */
+        INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, 0),
+        INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+
+        /* PASS whole datagram */
+        INSN(BPF_ALU | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, -1),
+        INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+    };
+
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_SOCKET_FILTER;
+    attr.insns = (uintptr_t)prog;
+    attr.insn_cnt = sizeof(prog) / sizeof(prog[0]);
+    attr.license = (uintptr_t)"Dual MIT/GPL";
+
+    return sys_bpf(BPF_PROG_LOAD, &attr);
+}
+
+/* Needs CAP_BPF (or root) and kernel 5.5+ for mapping the map, NULL with errno set on failure */
+dedup_filter_t *new_dedup_filter(const dedup_header_t *hdr, int size) {
+    dedup_filter_t *df = calloc(1, sizeof(dedup_filter_t));
+    df->map_fd = df->prog_fd = -1;
+
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_ARRAY;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(uint64_t);
+    attr.max_entries = WORDS + 1;
+    attr.map_flags = BPF_F_MMAPABLE;
+
+    long page = sysconf(_SC_PAGESIZE);
+    df->map_len = ((WORDS + 1) * sizeof(uint64_t) + page - 1) / page * page;
+
+    if((df->map_fd = sys_bpf(BPF_MAP_CREATE, &attr)) < 0) goto fail;
+
+    df->words = mmap(NULL, df->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, df->map_fd, 0);
+    if(df->words == MAP_FAILED) {
+        df->words = NULL;
+        goto fail;
+    }
+
+    if((df->prog_fd = dedup_filter_load(df, hdr)) < 0) goto fail;
+
+    dedup_filter_resize(df, size);
+    return df;
+
+fail:;
+    int err = errno;
+    free_dedup_filter(df);
+    errno = err;
+    return NULL;
+}
+
+/* Program to attach to sockets with SO_ATTACH_BPF */
+int dedup_filter_fd(dedup_filter_t *df) {
+    return df->prog_fd;
+}
+
+static void dedup_filter_set(dedup_filter_t *df, int seq, bool on) {
+    uint64_t bit = 1ULL << (seq & 63);
+    if(on) {
+        __atomic_fetch_or(&df->words[seq >> 6], bit, __ATOMIC_RELEASE);
+    } else {
+        __atomic_fetch_and(&df->words[seq >> 6], ~bit, __ATOMIC_RELEASE);
+    }
+}
+
+/* Call for every datagram accepted by lookup_push, so its copies are dropped by kernel */
+void dedup_filter_mark(dedup_filter_t *df, int seq) {
+    seq = (uint16_t)seq;
+
+    if(df->count == df->size) {
+        dedup_filter_set(df, df->ring[df->head], false);
+        df->count--;
+        df->head = (df->head + 1) % df->size;
+    }
+
+    df->ring[(df->head + df->count) % df->size] = seq;
+    df->count++;
+    dedup_filter_set(df, seq, true);
+}
+
+/* Forgets everything if size changes, size must not exceed the one of seen_lookup */
+void dedup_filter_resize(dedup_filter_t *df, int size) {
+    if(size < 1) size = 1;
+    if(size > SEQ_SPACE / 2) size = SEQ_SPACE / 2;
+    if(df->ring && size == df->size) return;
+
+    int i;
+    for(i = 0; i < WORDS; i++) __atomic_store_n(&df->words[i], 0, __ATOMIC_RELEASE);
+
+    free(df->ring);
+    df->ring = malloc(size * sizeof(uint16_t));
+    df->size = size;
+    df->head = df->count = 0;
+}
+
+unsigned long dedup_filter_dropped(dedup_filter_t *df) {
+    return __atomic_load_n(&df->words[COUNTER], __ATOMIC_RELAXED);
+}
+
+/* Sockets keep the program and the map until closed or detached */
+void free_dedup_filter(dedup_filter_t *df) {
+    if(df->words) munmap(df->words, df->map_len);
+    if(df->prog_fd >= 0) close(df->prog_fd);
+    if(df->map_fd >= 0) close(df->map_fd);
+    free(df->ring);
+    free(df);
+}
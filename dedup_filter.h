@@ -0,0 +1,25 @@
+#ifndef DEDUP_FILTER_H
+#define DEDUP_FILTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct _dedup_filter_t dedup_filter_t;
+
+/* Where the filter finds header fields, offsets from start of UDP payload */
+typedef struct {
+    size_t seq; /* 16 bit sequence number, network byte order */
+    size_t type;
+    uint8_t data; /* Only datagrams of this type are dropped */
+    size_t flags;
+    uint8_t keep; /* Datagrams with any of these flags are never dropped */
+} dedup_header_t;
+
+dedup_filter_t *new_dedup_filter(const dedup_header_t *hdr, int size);
+int dedup_filter_fd(dedup_filter_t *df);
+void dedup_filter_mark(dedup_filter_t *df, int seq);
+void dedup_filter_resize(dedup_filter_t *df, int size);
+unsigned long dedup_filter_dropped(dedup_filter_t *df);
+void free_dedup_filter(dedup_filter_t *df);
+
+#endif
@@ -0,0 +1,204 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Eugene Zagidullin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/*
+Bounded multi-producer single-consumer ring of fixed size slots.
+
+Producers claim a batch of slots with one CAS on the tail, fill them and
+commit each slot by stamping it with its position. Consumer walks committed
+slots from the head and frees them all with one store. Counters, producers'
+and consumer's data live on separate cache lines, slots are padded to cache
+lines, so producers only contend on the tail.
+
+Consumer sleeping on eventfd is woken up only when it has announced that the
+ring is empty (mpsc_arm), so busy rings cost no syscalls.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "mpsc.h"
+
+#define CACHE_LINE 64
+#define ALIGNED __attribute__((aligned(CACHE_LINE)))
+
+typedef struct {
+    /* Position + 1 when committed */
+    uint64_t seq;
+    uint32_t length;
+    uint8_t data[0];
+} slot_t;
+
+struct _mpsc_t {
+    /* Read-only after creation */
+    uint8_t *slots;
+    size_t slot_size;
+    size_t data_size;
+    uint64_t mask;
+    int efd;
+
+    /* Next position to claim */
+    ALIGNED uint64_t tail;
+
+    /* Next position to consume */
+    ALIGNED uint64_t head;
+
+    /* Consumer is about to sleep */
+    ALIGNED int waiting;
+};
+
+static slot_t *mpsc_get(mpsc_t *q, uint64_t pos) {
+    return (slot_t*)(q->slots + (pos & q->mask) * q->slot_size);
+}
+
+/* Number of slots is rounded up to power of 2, slot_size is max message length */
+mpsc_t *new_mpsc(size_t slots, size_t slot_size) {
+    size_t n = 1, i;
+    while(n < slots) n <<= 1;
+
+    int efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(efd < 0) return NULL;
+
+    mpsc_t *q;
+    if(posix_memalign((void**)&q, CACHE_LINE, sizeof(mpsc_t)) != 0) {
+        close(efd);
+        return NULL;
+    }
+    memset(q, 0, sizeof(mpsc_t));
+
+    q->data_size = slot_size;
+    q->slot_size = (sizeof(slot_t) + slot_size + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+    q->mask = n - 1;
+    q->efd = efd;
+
+    if(posix_memalign((void**)&q->slots, CACHE_LINE, n * q->slot_size) != 0) {
+        close(efd);
+        free(q);
+        return NULL;
+    }
+
+    /* Slot of position p is free while its seq is not p + 1 */
+    for(i = 0; i < n; i++) mpsc_get(q, i)->seq = 0;
+
+    return q;
+}
+
+void free_mpsc(mpsc_t *q) {
+    close(q->efd);
+    free(q->slots);
+    free(q);
+}
+
+/* Readable when consumer should look at the ring after mpsc_arm() */
+int mpsc_fd(mpsc_t *q) {
+    return q->efd;
+}
+
+/* Claim up to n consecutive slots starting at *pos. Returns number of claimed slots, 0 if ring is full */
+size_t mpsc_claim(mpsc_t *q, size_t n, uint64_t *pos) {
+    uint64_t size = q->mask + 1;
+    uint64_t tail = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+
+    do {
+        uint64_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+        uint64_t free_slots = size - (tail - head);
+        if(!free_slots) return 0;
+        if(n > free_slots) n = free_slots;
+    } while(!__atomic_compare_exchange_n(&q->tail, &tail, tail + n, true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    *pos = tail;
+    return n;
+}
+
+/* Data area of claimed slot */
+void *mpsc_slot(mpsc_t *q, uint64_t pos) {
+    return mpsc_get(q, pos)->data;
+}
+
+/* Make claimed slot visible to consumer */
+void mpsc_commit(mpsc_t *q, uint64_t pos, size_t length) {
+    slot_t *slot = mpsc_get(q, pos);
+    slot->length = length;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+/* Wake up consumer if it waits. Once per batch of commits is enough */
+void mpsc_notify(mpsc_t *q) {
+    /* Commits must be visible before checking the flag, pairs with mpsc_arm() */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if(!__atomic_load_n(&q->waiting, __ATOMIC_RELAXED)) return;
+    if(!__atomic_exchange_n(&q->waiting, 0, __ATOMIC_SEQ_CST)) return;
+
+    uint64_t one = 1;
+    while(write(q->efd, &one, sizeof(one)) < 0 && errno == EINTR);
+}
+
+/* Copy one message, returns -1 if ring is full or message doesn't fit */
+int mpsc_push(mpsc_t *q, const void *data, size_t length) {
+    uint64_t pos;
+    if(length > q->data_size || !mpsc_claim(q, 1, &pos)) return -1;
+
+    memcpy(mpsc_slot(q, pos), data, length);
+    mpsc_commit(q, pos, length);
+    mpsc_notify(q);
+    return 0;
+}
+
+/* Pass up to max committed messages to handler in claim order, then free their slots */
+size_t mpsc_consume(mpsc_t *q, mpsc_handler_t handler, void *ctx, size_t max) {
+    uint64_t head = q->head, pos = head;
+
+    while(pos - head < max) {
+        slot_t *slot = mpsc_get(q, pos);
+        if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1) break;
+
+        handler(ctx, slot->data, slot->length);
+        pos++;
+    }
+
+    if(pos != head) __atomic_store_n(&q->head, pos, __ATOMIC_RELEASE);
+    return pos - head;
+}
+
+/* Announce that consumer goes to sleep on mpsc_fd(). Returns false if there is work already */
+bool mpsc_arm(mpsc_t *q) {
+    __atomic_store_n(&q->waiting, 1, __ATOMIC_SEQ_CST);
+
+    slot_t *slot = mpsc_get(q, q->head);
+    if(__atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) == q->head + 1) {
+        __atomic_store_n(&q->waiting, 0, __ATOMIC_RELAXED);
+        return false;
+    }
+    return true;
+}
+
+/* Clear wakeup after mpsc_fd() became readable */
+void mpsc_ack(mpsc_t *q) {
+    uint64_t val;
+    while(read(q->efd, &val, sizeof(val)) < 0 && errno == EINTR);
+}
@@ -0,0 +1,28 @@
+#ifndef MPSC_H
+#define MPSC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct _mpsc_t mpsc_t;
+
+typedef void (*mpsc_handler_t)(void *ctx, const void *data, size_t length);
+
+mpsc_t *new_mpsc(size_t slots, size_t slot_size);
+void free_mpsc(mpsc_t *q);
+int mpsc_fd(mpsc_t *q);
+
+/* Producers */
+size_t mpsc_claim(mpsc_t *q, size_t n, uint64_t *pos);
+void *mpsc_slot(mpsc_t *q, uint64_t pos);
+void mpsc_commit(mpsc_t *q, uint64_t pos, size_t length);
+void mpsc_notify(mpsc_t *q);
+int mpsc_push(mpsc_t *q, const void *data, size_t length);
+
+/* Consumer */
+size_t mpsc_consume(mpsc_t *q, mpsc_handler_t handler, void *ctx, size_t max);
+bool mpsc_arm(mpsc_t *q);
+void mpsc_ack(mpsc_t *q);
+
+#endif
@@ -0,0 +1,164 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Eugene Zagidullin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+/*
+Lookup of queueing disciplines on the way out over rtnetlink: the egress
+interface of route to an address and qdiscs set up on it. Delaying datagrams
+by SO_TXTIME departure time is only done by etf and fq qdiscs, with any other
+qdisc the time is ignored and datagrams leave right away.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include "qdisc.h"
+#include "debug.h"
+
+#define NL_BUF_SZ 16384
+
+static int nl_open(void) {
+    int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if(fd < 0) return -1;
+
+    /* Called from event loop, kernel answers at once or not at all */
+    struct timeval tv = {.tv_sec = 1};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    return fd;
+}
+
+static void nl_attr(struct nlmsghdr *nlh, int type, const void *data, size_t len) {
+    struct rtattr *rta = (struct rtattr*)((uint8_t*)nlh + NLMSG_ALIGN(nlh->nlmsg_len));
+    rta->rta_type = type;
+    rta->rta_len = RTA_LENGTH(len);
+    memcpy(RTA_DATA(rta), data, len);
+    nlh->nlmsg_len = NLMSG_ALIGN(nlh->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+}
+
+/* Interface of route to dst, 0 if there is none */
+static int route_ifindex(int fd, const struct sockaddr *dst, uint32_t fwmark) {
+    uint32_t req[64];
+    memset(req, 0, sizeof(req));
+
+    struct nlmsghdr *nlh = (struct nlmsghdr*)req;
+    nlh->nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg));
+    nlh->nlmsg_type = RTM_GETROUTE;
+    nlh->nlmsg_flags = NLM_F_REQUEST;
+    struct rtmsg *rtm = NLMSG_DATA(nlh);
+
+    /* IPv4 address mapped into IPv6 socket is routed as IPv4 */
+    const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6*)dst;
+    if(dst->sa_family == AF_INET6 && !IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+        rtm->rtm_family = AF_INET6;
+        rtm->rtm_dst_len = 128;
+        nl_attr(nlh, RTA_DST, &sin6->sin6_addr, 16);
+    } else {
+        rtm->rtm_family = AF_INET;
+        rtm->rtm_dst_len = 32;
+        nl_attr(nlh, RTA_DST, dst->sa_family == AF_INET6 ? (const void*)&sin6->sin6_addr.s6_addr[12] :
+            (const void*)&((const struct sockaddr_in*)dst)->sin_addr, 4);
+    }
+    if(fwmark) nl_attr(nlh, RTA_MARK, &fwmark, sizeof(fwmark));
+
+    if(send(fd, req, nlh->nlmsg_len, 0) < 0) return -1;
+
+    uint32_t buf[NL_BUF_SZ / 4];
+    ssize_t len = recv(fd, buf, sizeof(buf), 0);
+    if(len < 0) return -1;
+
+    nlh = (struct nlmsghdr*)buf;
+    if(!NLMSG_OK(nlh, len)) return -1;
+    if(nlh->nlmsg_type == NLMSG_ERROR) return 0;
+    if(nlh->nlmsg_type != RTM_NEWROUTE) return -1;
+
+    rtm = NLMSG_DATA(nlh);
+    int attrlen = RTM_PAYLOAD(nlh);
+    struct rtattr *rta;
+    for(rta = RTM_RTA(rtm); RTA_OK(rta, attrlen); rta = RTA_NEXT(rta, attrlen)) {
+        if(rta->rta_type == RTA_OIF) return *(int*)RTA_DATA(rta);
+    }
+    return 0;
+}
+
+/* Whether any qdisc on interface, root or child, is of kind */
+static int ifindex_has_qdisc(int fd, int ifindex, const char *kind) {
+    struct {
+        struct nlmsghdr nlh;
+        struct tcmsg tcm;
+    } req;
+    memset(&req, 0, sizeof(req));
+    req.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(struct tcmsg));
+    req.nlh.nlmsg_type = RTM_GETQDISC;
+    req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    req.tcm.tcm_family = AF_UNSPEC;
+
+    if(send(fd, &req, req.nlh.nlmsg_len, 0) < 0) return -1;
+
+    /* Read whole dump even when found, it's the only request on the socket anyway */
+    uint32_t buf[NL_BUF_SZ / 4];
+    int found = 0;
+    for(;;) {
+        ssize_t len = recv(fd, buf, sizeof(buf), 0);
+        if(len < 0) return -1;
+
+        struct nlmsghdr *nlh;
+        for(nlh = (struct nlmsghdr*)buf; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+            if(nlh->nlmsg_type == NLMSG_DONE) return found;
+            if(nlh->nlmsg_type == NLMSG_ERROR) return -1;
+            if(nlh->nlmsg_type != RTM_NEWQDISC) continue;
+
+            struct tcmsg *tcm = NLMSG_DATA(nlh);
+            if(tcm->tcm_ifindex != ifindex) continue;
+
+            int attrlen = nlh->nlmsg_len - NLMSG_LENGTH(sizeof(struct tcmsg));
+            struct rtattr *rta;
+            for(rta = (struct rtattr*)((uint8_t*)tcm + NLMSG_ALIGN(sizeof(struct tcmsg))); RTA_OK(rta, attrlen); rta = RTA_NEXT(rta, attrlen)) {
+                if(rta->rta_type == TCA_KIND && strncmp(RTA_DATA(rta), kind, RTA_PAYLOAD(rta)) == 0) found = 1;
+            }
+        }
+    }
+}
+
+int qdisc_on_route(const struct sockaddr *dst, uint32_t fwmark, const char *device, const char *kind, char *ifname) {
+    int fd = nl_open();
+    if(fd < 0) return -1;
+
+    /* Socket bound to device sends through it whatever the routes say */
+    int ifindex = device ? (int)if_nametoindex(device) : route_ifindex(fd, dst, fwmark);
+    int ret = ifindex > 0 ? ifindex_has_qdisc(fd, ifindex, kind) : -1;
+    close(fd);
+
+    if(ifindex <= 0 || !if_indextoname(ifindex, ifname)) strcpy(ifname, "?");
+    X_DBG("route ifindex %d (%s), %s qdisc: %d\n", ifindex, ifname, kind, ret);
+
+    return ret;
+}
@@ -0,0 +1,12 @@
+#ifndef QDISC_H
+#define QDISC_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <net/if.h>
+
+/* 1 if qdisc of kind is set up on egress interface of route to dst, 0 if not, -1 if unknown.
+   Name of the interface is stored to ifname of IF_NAMESIZE bytes */
+int qdisc_on_route(const struct sockaddr *dst, uint32_t fwmark, const char *device, const char *kind, char *ifname);
+
+#endif
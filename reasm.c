@@ -0,0 +1,159 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Eugene Zagidullin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/*
+Reassembly of application level fragments. Datagram of length L split into N fragments
+has all fragments but last of equal size, so position of every fragment is known as soon
+as any non-last fragment arrives. Memory is bounded by number of slots, the oldest
+incomplete datagram is evicted when all slots are busy.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "reasm.h"
+#include "utils.h"
+#include "debug.h"
+
+#define REASM_MAX 65536
+#define REASM_TIMEOUT 1000000
+
+typedef struct _reasm_slot_t reasm_slot_t;
+
+struct _reasm_slot_t {
+    bool busy;
+    uint32_t key;
+    int frags;
+    int received;
+    uint64_t time;
+
+    /* Size of non-last fragment, 0 if unknown yet */
+    size_t frag_size;
+    /* Last fragment is kept at the end of buffer until frag_size is known */
+    size_t last_size;
+
+    uint8_t bitmap[32];
+    uint8_t *buffer;
+};
+
+struct _reasm_t {
+    reasm_slot_t *slots;
+    int slots_num;
+    size_t headroom;
+};
+
+reasm_t *new_reasm(int slots, size_t headroom) {
+    reasm_t *ra = calloc(1, sizeof(reasm_t));
+
+    ra->slots = calloc(slots, sizeof(reasm_slot_t));
+    ra->slots_num = slots;
+    ra->headroom = headroom;
+
+    return ra;
+}
+
+void free_reasm(reasm_t *ra) {
+    int i;
+    for(i = 0; i < ra->slots_num; i++) {
+        if(ra->slots[i].buffer) free(ra->slots[i].buffer);
+    }
+    free(ra->slots);
+    free(ra);
+}
+
+static reasm_slot_t *reasm_slot(reasm_t *ra, uint32_t key, int frags, uint64_t now) {
+    reasm_slot_t *free_slot = NULL, *oldest = NULL;
+
+    int i;
+    for(i = 0; i < ra->slots_num; i++) {
+        reasm_slot_t *s = &ra->slots[i];
+
+        if(s->busy && now - s->time >= REASM_TIMEOUT) s->busy = false;
+
+        if(s->busy) {
+            if(s->key == key && s->frags == frags) return s;
+            if(!oldest || s->time < oldest->time) oldest = s;
+        } else if(!free_slot) {
+            free_slot = s;
+        }
+    }
+
+    reasm_slot_t *s = free_slot ? free_slot : oldest;
+    X_DBG("%s slot for %u\n", free_slot ? "New" : "Evict", key);
+
+    if(!s->buffer) s->buffer = malloc(ra->headroom + REASM_MAX);
+    s->busy = true;
+    s->key = key;
+    s->frags = frags;
+    s->received = 0;
+    s->time = now;
+    s->frag_size = 0;
+    s->last_size = 0;
+    memset(s->bitmap, 0, sizeof(s->bitmap));
+
+    return s;
+}
+
+/*
+Add fragment. Returns length of complete datagram stored at *buffer after headroom, 0 if
+incomplete or -1 if fragment is malformed.
+*/
+ssize_t reasm_push(reasm_t *ra, uint32_t key, int frag, int frags, const void *data, size_t length, void **buffer) {
+    if(frags < 2 || frags > 256 || frag >= frags || !length) return -1;
+
+    reasm_slot_t *s = reasm_slot(ra, key, frags, time_usec());
+    if(s->bitmap[frag / 8] & (1 << (frag % 8))) return 0; /* Duplicated fragment */
+
+    uint8_t *payload = s->buffer + ra->headroom;
+    bool last = frag == frags - 1;
+
+    if(!last) {
+        if(s->frag_size && s->frag_size != length) return -1;
+        if((size_t)frags * length > REASM_MAX) return -1;
+
+        if(!s->frag_size) {
+            if(s->last_size > length) return -1;
+
+            s->frag_size = length;
+            /* Now place for last fragment is known */
+            if(s->last_size) {
+                memmove(payload + (frags - 1) * length, payload + REASM_MAX - s->last_size, s->last_size);
+            }
+        }
+        memcpy(payload + frag * length, data, length);
+    } else {
+        if(s->frag_size && length > s->frag_size) return -1;
+
+        s->last_size = length;
+        memcpy(payload + (s->frag_size ? (frags - 1) * s->frag_size : REASM_MAX - length), data, length);
+    }
+
+    s->bitmap[frag / 8] |= 1 << (frag % 8);
+    if(++s->received < frags) return 0;
+
+    s->busy = false;
+    *buffer = s->buffer;
+    return (frags - 1) * s->frag_size + s->last_size;
+}
@@ -0,0 +1,14 @@
+#ifndef REASM_H
+#define REASM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+typedef struct _reasm_t reasm_t;
+
+reasm_t *new_reasm(int slots, size_t headroom);
+ssize_t reasm_push(reasm_t *ra, uint32_t key, int frag, int frags, const void *data, size_t length, void **buffer);
+void free_reasm(reasm_t *ra);
+
+#endif
@@ -27,29 +27,62 @@ SOFTWARE.
 #include <syslog.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <netdb.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <syslog.h>
 #include <netinet/in.h>
+#include <netinet/ip.h>
 #include <arpa/inet.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <linux/if_tun.h>
+#include <linux/net_tstamp.h>
 
 #include "relay.h"
+#include "qdisc.h"
 #include "utils.h"
 #include "clist.h"
 #include "debug.h"
 
 #define BUF_SZ 65536
 
+/* Default token bucket depth: 10ms worth of traffic, but at least two full datagrams */
+#define BURST_USEC 10000
+#define MIN_BURST 3000
+
+/* Try configured MTU again after this time, kernel expires learned PMTU after 10 minutes too */
+#define MTU_PROBE_USEC 600000000ULL
+
+/* Relay state machine timings */
+#define SUSPECT_USEC 3000000    /* Sending but nothing received for this long, probe, then suspect after twice as long */
+#define PROBE_USEC 500000       /* Probe interval while suspect or probing */
+#define DOWN_USEC 10000000      /* No answer to probes for this long */
+#define BACKOFF_MIN 1000000     /* Reopen delay, doubled on every failure */
+#define BACKOFF_MAX 60000000
+
 struct _queue_t {
     void *buffer;
     size_t length;
+    /* Not to be sent before, 0 = any time */
+    uint64_t due;
 
     queue_t *_prev;
     queue_t *_next;
 };
 
 static bool relay_queued(relay_t *relay);
+static void relay_refill(relay_t *relay, uint64_t now);
+static void relay_update_mtu(relay_t *relay);
+static void relay_setsockopts(relay_t *relay);
+static uint64_t relay_head_due(relay_t *relay);
+static clockid_t socket_txtime_clock(relay_t *relay);
+static int socket_route(relay_t *relay, int fd, int family, bool reset);
+
+/* I/O used by relays created from config */
+static const relay_io_t *default_io = &relay_socket_io;
 
 static void split_addr(char *src, char **host, char **service) {
     *host = src;
@@ -71,44 +104,47 @@ static void dump_sockaddr(const struct sockaddr *sa) {
 #   define dump_sockaddr(sa)
 #endif
 
-/* Create new relay */
-relay_t *new_relay(const relay_config_t *config) {
-    /* Resolve local address */
+/* Resolve addresses, create and bind socket */
+static int socket_open(relay_t *relay) {
     char *local_addr = NULL, *local_host = NULL, *local_service = NULL;
     char *remote_addr = NULL, *remote_host = NULL, *remote_service = NULL;
 
-    if(config->local_addr) {
-        local_addr = xstrdup(config->local_addr);
+    if(relay->local_addr) {
+        local_addr = xstrdup(relay->local_addr);
         split_addr(local_addr, &local_host, &local_service);
     }
 
-    if(config->remote_addr) {
-        remote_addr = xstrdup(config->remote_addr);
+    if(relay->remote_addr) {
+        remote_addr = xstrdup(relay->remote_addr);
         split_addr(remote_addr, &remote_host, &remote_service);
-
-        if(!remote_service) {
-            if(local_addr) free(local_addr);
-            free(remote_addr);
-            syslog(LOG_ERR, "Port number is not specified for %s", config->remote_addr);
-            return NULL;
-        }
     }
 
+    /* Resolve local address */
     struct addrinfo hints, *res_local;
     memset(&hints, 0, sizeof(struct addrinfo));
     hints.ai_family = AF_UNSPEC;
     hints.ai_socktype = SOCK_DGRAM;
-    hints.ai_flags = local_host ? AI_PASSIVE : 0;
-    
-    int err;
-    if(X_UNLIKELY((err = getaddrinfo(local_host ? (local_host[0] != '*' ? local_host : NULL) : remote_host,
+    hints.ai_flags = local_host ? AI_PASSIVE : AI_NUMERICHOST;
+
+    int err = getaddrinfo(local_host ? (local_host[0] != '*' ? local_host : NULL) : remote_host,
             local_host ? local_service : remote_service,
-            &hints, &res_local)) != 0)) {
+            &hints, &res_local);
+
+    /* Host name to forward to is left to the asynchronous resolver too, meanwhile
+       the socket is an IPv6 one which can reach IPv4 addresses as well */
+    bool any = !local_host && err == EAI_NONAME;
+    if(any) {
+        hints.ai_family = AF_INET6;
+        hints.ai_flags = AI_PASSIVE | AI_NUMERICHOST;
+        err = getaddrinfo(NULL, "0", &hints, &res_local);
+    }
 
-        syslog(LOG_ERR, "%s: %s", config->local_addr ? config->local_addr : config->remote_addr, gai_strerror(err));
+    if(X_UNLIKELY(err != 0)) {
+
+        syslog(LOG_ERR, "%s: %s", relay->local_addr ? relay->local_addr : relay->remote_addr, gai_strerror(err));
         if(local_addr) free(local_addr);
         if(remote_addr) free(remote_addr);
-        return NULL;
+        return -1;
     }
 
     int fd = -1;
@@ -124,7 +160,17 @@ relay_t *new_relay(const relay_config_t *config) {
 
         X_DBG("fd[%d] af=AF_INET%s\n", fd, r->ai_family == AF_INET6 ? "6" : "");
 
-        if(!config->local_addr) {
+        if(any) {
+            if(setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &(int){0}, sizeof(int)) < 0) {
+                close(fd);
+                fd = -1;
+                continue;
+            }
+            local_ai = *r;
+            break;
+        }
+
+        if(!relay->local_addr) {
             memcpy(&remote_sa, r->ai_addr, r->ai_addrlen);
             remote_sa_len = r->ai_addrlen;
             break;
@@ -132,10 +178,20 @@ relay_t *new_relay(const relay_config_t *config) {
 
         if(X_UNLIKELY(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) < 0)) {
             close(fd);
+            freeaddrinfo(res_local);
             if(local_addr) free(local_addr);
             if(remote_addr) free(remote_addr);
             syslog(LOG_ERR, "%m");
-            return NULL;
+            return -1;
+        }
+
+        if(X_UNLIKELY(socket_route(relay, fd, r->ai_family, false) < 0)) {
+            syslog(LOG_ERR, "%s: %m", relay->device ? relay->device : relay->local_addr);
+            close(fd);
+            freeaddrinfo(res_local);
+            if(local_addr) free(local_addr);
+            if(remote_addr) free(remote_addr);
+            return -1;
         }
 
         if(X_UNLIKELY(bind(fd, r->ai_addr, r->ai_addrlen) < 0)) {
@@ -153,39 +209,46 @@ relay_t *new_relay(const relay_config_t *config) {
     freeaddrinfo(res_local);
 
     if(fd < 0) {
-        syslog(LOG_ERR, "%s: %m", config->local_addr ? config->local_addr : config->remote_addr);
+        syslog(LOG_ERR, "%s: %m", relay->local_addr ? relay->local_addr : relay->remote_addr);
         if(local_addr) free(local_addr);
         if(remote_addr) free(remote_addr);
-        return NULL;
+        return -1;
     }
 
-    /* Resolve remote address */
-    if(config->remote_addr && config->local_addr) {
+    /* Resolve remote address. Host names are left to the asynchronous resolver,
+       keep last known address meanwhile */
+    if(relay->remote_addr && (relay->local_addr || any)) {
         struct addrinfo *res_remote;
         memset(&hints, 0, sizeof(struct addrinfo));
         hints.ai_family = local_ai.ai_family;
         hints.ai_socktype = local_ai.ai_socktype;
         hints.ai_protocol = local_ai.ai_protocol;
+        hints.ai_flags = AI_NUMERICHOST;
 
-        if(X_UNLIKELY((err = getaddrinfo(remote_host, remote_service, &hints, &res_remote)) != 0)) {
-            syslog(LOG_ERR, "%s: %s", remote_host, gai_strerror(err));
-            close(fd);
-            if(local_addr) free(local_addr);
-            if(remote_addr) free(remote_addr);
-            return NULL;
+        if(getaddrinfo(remote_host, remote_service, &hints, &res_remote) == 0) {
+            memcpy(&remote_sa, res_remote->ai_addr, res_remote->ai_addrlen);
+            remote_sa_len = res_remote->ai_addrlen;
+            freeaddrinfo(res_remote);
+            relay->resolve = false;
+        } else {
+            relay->resolve = true;
+            relay->resolve_time = 0;
+            if(relay->remote_sa_len && relay->remote_sa.sa.sa_family == local_ai.ai_family) {
+                remote_sa = relay->remote_sa;
+                remote_sa_len = relay->remote_sa_len;
+            } else {
+                relay->remote_sa_len = 0;
+            }
         }
-
-        memcpy(&remote_sa, res_remote->ai_addr, res_remote->ai_addrlen);
-        remote_sa_len = res_remote->ai_addrlen;
-
-        freeaddrinfo(res_remote);
     }
 
     int flags = fcntl(fd, F_GETFL, 0);
     fcntl(fd, F_SETFL, flags | O_NONBLOCK);
 
-    /* New relay */
-    relay_t *relay = calloc(1, sizeof(relay_t));
+    /* Arrival time taken by kernel doesn't include time spent in event loop */
+    if(X_UNLIKELY(setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &(int){1}, sizeof(int)) < 0)) {
+        X_DBG("fd[%d] SO_TIMESTAMPNS: %s\n", fd, strerror(errno));
+    }
 
     if(remote_sa_len) {
         X_DBG("fd[%d] remote ", fd);
@@ -193,38 +256,386 @@ relay_t *new_relay(const relay_config_t *config) {
 
         memcpy(&relay->remote_sa, &remote_sa, remote_sa_len);
         relay->remote_sa_len = remote_sa_len;
-    } else {
+    } else if(!relay->remote_addr) {
         relay->dynamic_out_addr = true;
     }
 
     relay->fd = fd;
-    if(config->local_addr) relay->local_addr = xstrdup(config->local_addr);
-    if(config->remote_addr) relay->remote_addr = xstrdup(config->remote_addr);
+    relay->family = local_ai.ai_addrlen ? local_ai.ai_family : remote_sa.sa.sa_family;
+    relay->v4mapped = any;
 
     if(local_addr) free(local_addr);
     if(remote_addr) free(remote_addr);
 
-    return relay;
+    return 0;
 }
 
-void free_relay(relay_t *relay) {
+static void fd_close(relay_t *relay) {
     close(relay->fd);
+}
 
-    if(relay->send_buffer) free(relay->send_buffer);
-    if(relay->recv_buffer) free(relay->recv_buffer);
+/* TUN device named local_addr, the kernel may pick the name */
+static int tun_open(relay_t *relay) {
+    int fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if(fd < 0) {
+        syslog(LOG_ERR, "/dev/net/tun: %m");
+        return -1;
+    }
+
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+    strncpy(ifr.ifr_name, relay->local_addr, IFNAMSIZ - 1);
+
+    if(ioctl(fd, TUNSETIFF, &ifr) < 0) {
+        syslog(LOG_ERR, "%s: %m", relay->local_addr);
+        close(fd);
+        return -1;
+    }
+
+    free(relay->local_addr);
+    relay->local_addr = xstrdup(ifr.ifr_name);
+    relay->fd = fd;
+    return 0;
+}
+
+static int relay_open(relay_t *relay) {
+    if(relay->io->open(relay) < 0) return -1;
 
+    relay->recv_time = time_usec();
+    relay_setsockopts(relay);
+    return 0;
+}
+
+static void relay_close(relay_t *relay) {
+    if(relay->fd < 0) return;
+
+    relay->io->close(relay);
+    relay->fd = -1;
+    relay->filter_attached = -1;
+}
+
+/* Relays created after this call use given I/O */
+void relay_set_io(const relay_io_t *io) {
+    default_io = io;
+}
+
+/* Drop everything waiting to be sent or received */
+static void relay_flush(relay_t *relay) {
     queue_t *q;
     while((q = relay->queue) != NULL) {
         CLIST_DEL(relay->queue, q);
         free(q->buffer);
         free(q);
     }
+    relay->queue_len = 0;
+    relay->send_size = 0;
+    relay->recv_size = 0;
+}
+
+/* Create new relay */
+relay_t *new_relay(const relay_config_t *config) {
+    if(config->remote_addr && !strchr(config->remote_addr, ':')) {
+        syslog(LOG_ERR, "Port number is not specified for %s", config->remote_addr);
+        return NULL;
+    }
+
+    relay_t *relay = calloc(1, sizeof(relay_t));
+    relay->fd = -1;
+    relay->filter = relay->filter_attached = -1;
+    relay->io = default_io;
+    relay->backoff = BACKOFF_MIN;
+
+    if(config->local_addr) relay->local_addr = xstrdup(config->local_addr);
+    if(config->remote_addr) relay->remote_addr = xstrdup(config->remote_addr);
+
+    relay->tokens_time = time_usec();
+    relay_configure(relay, config);
+    relay->tokens = relay->burst;
+
+    if(relay_open(relay) < 0) {
+        free_relay(relay);
+        return NULL;
+    }
+
+    return relay;
+}
+
+/* Outward interface which is a TUN device carrying IP packets instead of UDP socket */
+relay_t *new_tun_relay(const char *name) {
+    relay_t *relay = calloc(1, sizeof(relay_t));
+    relay->fd = -1;
+    relay->filter = relay->filter_attached = -1;
+    relay->io = &relay_tun_io;
+    relay->tun = true;
+    relay->backoff = BACKOFF_MIN;
+    relay->local_addr = xstrdup(name);
+    relay->tokens_time = time_usec();
+
+    if(relay_open(relay) < 0) {
+        free_relay(relay);
+        return NULL;
+    }
+
+    return relay;
+}
+
+void free_relay(relay_t *relay) {
+    relay_close(relay);
+
+    if(relay->send_buffer) free(relay->send_buffer);
+    if(relay->recv_buffer) free(relay->recv_buffer);
+
+    relay_flush(relay);
+
     if(relay->local_addr) free(relay->local_addr);
     if(relay->remote_addr) free(relay->remote_addr);
+    if(relay->device) free(relay->device);
     free(relay);
 }
 
+static const char *relay_name(relay_t *relay) {
+    return relay->remote_addr ? relay->remote_addr : relay->local_addr;
+}
+
+static void relay_set_state(relay_t *relay, relay_state_t state, uint64_t now) {
+    static const char *names[] = {"up", "suspect", "down", "probing"};
+
+    if(state == RELAY_UP) relay->backoff = BACKOFF_MIN;
+
+    syslog(state == RELAY_DOWN ? LOG_WARNING : LOG_INFO, "Relay %s is %s", relay_name(relay), names[state]);
+    relay->state = state;
+    relay->state_time = now;
+}
+
+/* Close socket and schedule reopening */
+void relay_down(relay_t *relay) {
+    uint64_t now = time_usec();
+
+    relay_close(relay);
+    relay_flush(relay);
+
+    relay_set_state(relay, RELAY_DOWN, now);
+    relay->retry_time = now + relay->backoff;
+    relay->backoff = MIN(relay->backoff * 2, BACKOFF_MAX);
+}
+
+/* Transient error, check path with probes */
+static void relay_suspect(relay_t *relay) {
+    if(relay->state == RELAY_UP) relay_set_state(relay, RELAY_SUSPECT, time_usec());
+}
+
+/* Relay may carry traffic */
+bool relay_active(relay_t *relay) {
+    return relay->state == RELAY_UP || relay->state == RELAY_SUSPECT;
+}
+
+/* Time driven state transitions. Returns true if probe should be sent now */
+bool relay_update(relay_t *relay, uint64_t now) {
+    switch(relay->state) {
+        case RELAY_UP:
+            /* Sending but hearing nothing from peer, ask for an answer first */
+            if(relay->dynamic_out_addr || now - relay->recv_time < SUSPECT_USEC ||
+                now - relay->send_time >= SUSPECT_USEC) return false;
+
+            if(now - relay->recv_time >= 2 * SUSPECT_USEC) relay_set_state(relay, RELAY_SUSPECT, now);
+            break;
+
+        case RELAY_SUSPECT:
+        case RELAY_PROBING:
+            if(now - relay->state_time >= DOWN_USEC) {
+                relay_down(relay);
+                return false;
+            }
+            break;
+
+        case RELAY_DOWN:
+            if(now < relay->retry_time) return false;
+
+            /* Resolve and bind again */
+            if(relay_open(relay) < 0) {
+                relay->retry_time = now + relay->backoff;
+                relay->backoff = MIN(relay->backoff * 2, BACKOFF_MAX);
+                return false;
+            }
+
+            if(relay->dynamic_out_addr) {
+                /* Nothing to probe, wait for peer */
+                relay_set_state(relay, RELAY_UP, now);
+                return false;
+            }
+
+            relay_set_state(relay, RELAY_PROBING, now);
+            relay->probe_time = 0;
+            break;
+    }
+
+    if(now - relay->probe_time < PROBE_USEC) return false;
+
+    relay->probe_time = now;
+    return true;
+}
+
+/* Apply options which can be changed on the fly */
+void relay_configure(relay_t *relay, const relay_config_t *config) {
+    relay->queue_limit = config->queue;
+    relay->burst_limit = config->burst;
+    relay->weight = config->weight;
+    relay->rcvbuf = config->rcvbuf;
+    relay->sndbuf = config->sndbuf;
+    relay->offset = config->offset;
+    relay->txtime = config->txtime;
+    relay->path = config->path;
+    relay_set_rate(relay, config->rate / 8);
+    relay_setsockopts(relay);
+
+    bool route = relay->fwmark != config->fwmark || relay->tos != config->tos ||
+        (relay->device && config->device ? strcmp(relay->device, config->device) != 0 : relay->device != config->device);
+
+    if(route) {
+        if(relay->device) free(relay->device);
+        relay->device = config->device ? xstrdup(config->device) : NULL;
+        relay->fwmark = config->fwmark;
+        relay->tos = config->tos;
+
+        if(relay->fd >= 0 && relay->io->route && X_UNLIKELY(relay->io->route(relay) < 0)) {
+            syslog(LOG_WARNING, "%s: %m", relay_name(relay));
+        }
+    }
+}
+
+/* Pin socket to interface, policy routing table (by fwmark) and QoS class.
+   Options which are not set are left alone unless reset is requested */
+static int socket_route(relay_t *relay, int fd, int family, bool reset) {
+    if(relay->device || reset) {
+        const char *dev = relay->device ? relay->device : "";
+        if(setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, dev, strlen(dev)) < 0) return -1;
+    }
+
+    if((relay->fwmark || reset) && setsockopt(fd, SOL_SOCKET, SO_MARK, &relay->fwmark, sizeof(relay->fwmark)) < 0) {
+        return -1;
+    }
+
+    if(relay->tos || reset) {
+        int ret;
+        if(family == AF_INET6) {
+            ret = setsockopt(fd, IPPROTO_IPV6, IPV6_TCLASS, &relay->tos, sizeof(int));
+        } else {
+            ret = setsockopt(fd, IPPROTO_IP, IP_TOS, &relay->tos, sizeof(int));
+        }
+        if(ret < 0) return -1;
+    }
+
+    return 0;
+}
+
+static int socket_reroute(relay_t *relay) {
+    return socket_route(relay, relay->fd, relay->family, true);
+}
+
+static ssize_t socket_sendto(relay_t *relay, const void *buffer, size_t length) {
+#ifdef SO_TXTIME
+    if(relay->txtime_on) {
+        /* Departure time for qdisc */
+        struct timespec ts;
+        clock_gettime(socket_txtime_clock(relay), &ts);
+        uint64_t txtime = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec + (uint64_t)relay->offset * 1000;
+
+        struct iovec iov = {.iov_base = (void*)buffer, .iov_len = length};
+        uint8_t control[CMSG_SPACE(sizeof(uint64_t))] __attribute__((aligned(sizeof(size_t))));
+        memset(control, 0, sizeof(control));
+        struct msghdr msg = {
+            .msg_name = &relay->remote_sa.sa,
+            .msg_namelen = relay->remote_sa_len,
+            .msg_iov = &iov,
+            .msg_iovlen = 1,
+            .msg_control = control,
+            .msg_controllen = sizeof(control),
+        };
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_TXTIME;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+        memcpy(CMSG_DATA(cmsg), &txtime, sizeof(uint64_t));
+
+        return sendmsg(relay->fd, &msg, 0);
+    }
+#endif
+    return sendto(relay->fd, buffer, length, 0, &relay->remote_sa.sa, relay->remote_sa_len);
+}
+
+/* Kernel receive timestamp is wall clock time, convert it by its age */
+static uint64_t socket_stamp(const struct timespec *ts) {
+    struct timespec real;
+    clock_gettime(CLOCK_REALTIME, &real);
+
+    int64_t age = (int64_t)(real.tv_sec - ts->tv_sec) * 1000000 + (real.tv_nsec - ts->tv_nsec) / 1000;
+    uint64_t now = time_usec();
+    return age > 0 && (uint64_t)age < now ? now - age : now;
+}
+
+static ssize_t socket_recvfrom(relay_t *relay, void *buffer, size_t size, sockaddr_t *sa, socklen_t *salen, uint64_t *stamp) {
+    struct iovec iov = {.iov_base = buffer, .iov_len = size};
+    uint8_t control[CMSG_SPACE(sizeof(struct timespec))] __attribute__((aligned(sizeof(size_t))));
+    struct msghdr msg = {
+        .msg_name = &sa->sa,
+        .msg_namelen = *salen,
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+
+    ssize_t sz = recvmsg(relay->fd, &msg, 0);
+    if(sz < 0) return sz;
+    *salen = msg.msg_namelen;
+
+    struct cmsghdr *cmsg;
+    for(cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            struct timespec ts;
+            memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+            *stamp = socket_stamp(&ts);
+        }
+    }
+
+    return sz;
+}
+
+/* TUN device takes and gives whole packets with plain read() and write() */
+static ssize_t tun_write(relay_t *relay, const void *buffer, size_t length) {
+    ssize_t sz = write(relay->fd, buffer, length);
+
+    /* Interface is down or packet is malformed, drop it */
+    if(sz < 0 && (errno == EIO || errno == EINVAL)) {
+        X_DBG("%s: %s\n", relay->local_addr, strerror(errno));
+        return length;
+    }
+    return sz;
+}
+
+static ssize_t tun_read(relay_t *relay, void *buffer, size_t size, sockaddr_t *sa, socklen_t *salen, uint64_t *stamp) {
+    memset(sa, 0, sizeof(sockaddr_t));
+    *salen = 0;
+    return read(relay->fd, buffer, size);
+}
+
+static ssize_t relay_sendto(relay_t *relay, const void *buffer, size_t length) {
+    ssize_t sz = relay->io->sendto(relay, buffer, length);
+    if(X_UNLIKELY(relay->capture != NULL) && sz > 0) capture_packet(relay->capture, relay->capture_if, CAPTURE_OUT, buffer, sz);
+    return sz;
+}
+
+static ssize_t relay_recvfrom(relay_t *relay, void *buffer, size_t size, sockaddr_t *sa, socklen_t *salen, uint64_t *stamp) {
+    ssize_t sz = relay->io->recvfrom(relay, buffer, size, sa, salen, stamp);
+    if(X_UNLIKELY(relay->capture != NULL) && sz > 0) capture_packet(relay->capture, relay->capture_if, CAPTURE_IN, buffer, sz);
+    return sz;
+}
+
 static const char *relay_remote_sa(relay_t *relay) {
+    if(relay->tun) return relay->local_addr;
+
     if(relay->remote_sa.sa.sa_family == AF_INET6) {
         inet_ntop(AF_INET6, &((struct sockaddr_in6*)(&relay->remote_sa.sa))->sin6_addr, relay->remote_sa_buf, INET6_ADDRSTRLEN);
     } else {
@@ -237,43 +648,379 @@ static bool relay_queued(relay_t *relay) {
     return relay->queue || relay->send_size;
 }
 
+/* Apply socket options derived from relay settings, also after reopening */
+static void relay_setsockopts(relay_t *relay) {
+    if(relay->fd >= 0 && relay->io->setsockopts) relay->io->setsockopts(relay);
+}
+
+/* Privileged process may go beyond net.core.rmem_max and wmem_max */
+static void socket_setbuf(relay_t *relay, int force_opt, int opt, int size) {
+    int cur;
+    socklen_t len = sizeof(cur);
+
+    /* Kernel doubles requested size for bookkeeping */
+    if(getsockopt(relay->fd, SOL_SOCKET, opt, &cur, &len) == 0 && cur == size * 2) return;
+
+    if(setsockopt(relay->fd, SOL_SOCKET, force_opt, &size, sizeof(size)) < 0 &&
+        X_UNLIKELY(setsockopt(relay->fd, SOL_SOCKET, opt, &size, sizeof(size)) < 0)) {
+
+        syslog(LOG_WARNING, "%s: %m", relay_name(relay));
+    }
+}
+
+static clockid_t socket_txtime_clock(relay_t *relay) {
+    return relay->txtime == TXTIME_ETF ? CLOCK_TAI : CLOCK_MONOTONIC;
+}
+
+/* Without etf or fq qdisc on the way out the departure time is ignored, check it
+   once the remote address is known. Can't tell = trust the config */
+static bool socket_txtime_qdisc(relay_t *relay) {
+    if(!relay->remote_sa_len) return true;
+
+    const char *kind = relay->txtime == TXTIME_ETF ? "etf" : "fq";
+    char ifname[IF_NAMESIZE];
+    int ret = qdisc_on_route(&relay->remote_sa.sa, relay->fwmark, relay->device, kind, ifname);
+    if(ret == 0 && !relay->txtime_no_qdisc) syslog(LOG_WARNING, "%s: no %s qdisc on %s, delaying in send queue", relay_name(relay), kind, ifname);
+
+    relay->txtime_no_qdisc = ret == 0;
+    return ret != 0;
+}
+
+/* Let qdisc delay datagrams, holding them in send queue is the fallback */
+static void socket_txtime(relay_t *relay) {
+#ifdef SO_TXTIME
+    if(relay->txtime == TXTIME_QUEUE || !relay->offset || !socket_txtime_qdisc(relay)) {
+        relay->txtime_on = false;
+        return;
+    }
+
+    /* Stays enabled on socket once set, datagrams without departure time aren't delayed */
+    struct sock_txtime cfg = {.clockid = socket_txtime_clock(relay)};
+    bool on = setsockopt(relay->fd, SOL_SOCKET, SO_TXTIME, &cfg, sizeof(cfg)) == 0;
+    if(X_UNLIKELY(!on) && relay->txtime_on != on) syslog(LOG_WARNING, "%s: SO_TXTIME: %m, delaying in send queue", relay_name(relay));
+
+    relay->txtime_on = on;
+#endif
+}
+
+/* Let fq qdisc spread datagrams over time too */
+static void socket_pacing(relay_t *relay) {
+#ifdef SO_MAX_PACING_RATE
+    if(relay->rate) {
+        unsigned int pacing = MIN(relay->rate, (uint64_t)~0U);
+        if(X_UNLIKELY(setsockopt(relay->fd, SOL_SOCKET, SO_MAX_PACING_RATE, &pacing, sizeof(pacing)) < 0)) {
+            X_DBG("fd[%d] SO_MAX_PACING_RATE: %s\n", relay->fd, strerror(errno));
+        }
+    }
+#endif
+}
+
+static void socket_setsockopts(relay_t *relay) {
+    if(relay->rcvbuf) socket_setbuf(relay, SO_RCVBUFFORCE, SO_RCVBUF, relay->rcvbuf);
+    if(relay->sndbuf) socket_setbuf(relay, SO_SNDBUFFORCE, SO_SNDBUF, relay->sndbuf);
+    socket_txtime(relay);
+
+    if(relay->mtu_limit) {
+        /* Forbid IP fragmentation */
+        int ret;
+        if(relay->family == AF_INET6) {
+            ret = setsockopt(relay->fd, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &(int){IPV6_PMTUDISC_DO}, sizeof(int));
+        } else {
+            ret = setsockopt(relay->fd, IPPROTO_IP, IP_MTU_DISCOVER, &(int){IP_PMTUDISC_DO}, sizeof(int));
+        }
+        if(X_UNLIKELY(ret < 0)) syslog(LOG_WARNING, "%s: %m", relay_name(relay));
+    }
+
+    socket_pacing(relay);
+
+#ifdef SO_BUSY_POLL
+    /* Raising busy poll time needs CAP_NET_ADMIN, give up until next reload if not permitted */
+    if(relay->busy_poll || relay->busy_poll_reset) {
+        if(X_UNLIKELY(setsockopt(relay->fd, SOL_SOCKET, SO_BUSY_POLL, &relay->busy_poll, sizeof(int)) < 0)) {
+            syslog(LOG_WARNING, "%s: SO_BUSY_POLL: %m", relay_name(relay));
+            relay->busy_poll = 0;
+        }
+#ifdef SO_PREFER_BUSY_POLL
+        /* Keep device interrupts masked while the application polls */
+        if(X_UNLIKELY(setsockopt(relay->fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &(int){relay->busy_poll != 0}, sizeof(int)) < 0)) {
+            X_DBG("fd[%d] SO_PREFER_BUSY_POLL: %s\n", relay->fd, strerror(errno));
+        }
+#endif
+        relay->busy_poll_reset = false;
+    }
+#endif
+
+#ifdef SO_ATTACH_BPF
+    /* Loading the program is what needs privileges, attaching it doesn't */
+    if(relay->filter != relay->filter_attached) {
+        int ret = relay->filter >= 0 ?
+            setsockopt(relay->fd, SOL_SOCKET, SO_ATTACH_BPF, &relay->filter, sizeof(int)) :
+            setsockopt(relay->fd, SOL_SOCKET, SO_DETACH_BPF, &(int){0}, sizeof(int));
+        if(X_UNLIKELY(ret < 0)) syslog(LOG_WARNING, "%s: SO_ATTACH_BPF: %m", relay_name(relay));
+        relay->filter_attached = relay->filter;
+    }
+#endif
+}
+
+/* rate is in bytes per second */
+void relay_set_rate(relay_t *relay, uint64_t rate) {
+    /* Keep tokens accumulated with previous rate */
+    relay_refill(relay, time_usec());
+
+    relay->rate = rate;
+    relay->burst = relay->burst_limit ? relay->burst_limit : MAX(relay->rate * BURST_USEC / 1000000, MIN_BURST);
+    if(relay->tokens > relay->burst) relay->tokens = relay->burst;
+
+    /* Congestion control changes rate often, leave other options alone */
+    if(relay->fd >= 0 && relay->io->pacing) relay->io->pacing(relay);
+}
+
+/* Limit datagram size and forbid IP fragmentation on this relay */
+void relay_set_mtu(relay_t *relay, size_t mtu) {
+    relay->mtu = relay->mtu_limit = mtu;
+    relay->mtu_time = time_usec();
+
+    relay_setsockopts(relay);
+}
+
+/* Busy poll socket for up to usec when nothing is received, 0 to disable */
+void relay_set_busy_poll(relay_t *relay, int usec) {
+    if(usec == relay->busy_poll) return;
+
+    relay->busy_poll_reset = !usec;
+    relay->busy_poll = usec;
+
+    relay_setsockopts(relay);
+}
+
+/* Attach eBPF socket filter program, -1 to detach */
+void relay_set_filter(relay_t *relay, int prog_fd) {
+    if(prog_fd == relay->filter) return;
+
+    relay->filter = prog_fd;
+    relay_setsockopts(relay);
+}
+
+/* Max datagram size, periodically probes if path MTU has grown */
+size_t relay_mtu(relay_t *relay) {
+    if(relay->mtu < relay->mtu_limit) {
+        uint64_t now = time_usec();
+        if(now - relay->mtu_time >= MTU_PROBE_USEC) {
+            relay->mtu = relay->mtu_limit;
+            relay->mtu_time = now;
+        }
+    }
+    return relay->mtu;
+}
+
+/* Unconnected socket can't report path MTU, so ask connected one */
+static size_t socket_path_mtu(relay_t *relay) {
+    bool inet6 = relay->remote_sa.sa.sa_family == AF_INET6;
+    size_t overhead = (inet6 ? 40 : sizeof(struct iphdr)) + 8;
+    size_t mtu = 0;
+
+    int fd = socket(relay->remote_sa.sa.sa_family, SOCK_DGRAM, 0);
+    if(fd >= 0) {
+        int val;
+        socklen_t len = sizeof(int);
+
+        if(connect(fd, &relay->remote_sa.sa, relay->remote_sa_len) == 0 &&
+            getsockopt(fd, inet6 ? IPPROTO_IPV6 : IPPROTO_IP, inet6 ? IPV6_MTU : IP_MTU, &val, &len) == 0 &&
+            (size_t)val > overhead) {
+
+            mtu = val - overhead;
+        }
+        close(fd);
+    }
+    return mtu;
+}
+
+/* Called on EMSGSIZE */
+static void relay_update_mtu(relay_t *relay) {
+    if(!relay->mtu_limit || !relay->remote_sa_len) return;
+
+    size_t mtu = relay->io->path_mtu ? relay->io->path_mtu(relay) : 0;
+
+    /* Path MTU is unknown, step down */
+    if(!mtu || mtu >= relay->mtu) mtu = relay->mtu - relay->mtu / 4;
+
+    relay->mtu = MIN(MAX(mtu, MIN_MTU), relay->mtu_limit);
+    relay->mtu_time = time_usec();
+    syslog(LOG_INFO, "%s: datagram size limited to %lu", relay_remote_sa(relay), (unsigned long)relay->mtu);
+}
+
+/* New remote address from resolver. New path may have different MTU */
+void relay_set_remote(relay_t *relay, const struct sockaddr *sa, socklen_t len) {
+    struct sockaddr_in6 mapped;
+    if(relay->v4mapped && sa->sa_family == AF_INET) {
+        const struct sockaddr_in *sin = (const struct sockaddr_in*)sa;
+        memset(&mapped, 0, sizeof(mapped));
+        mapped.sin6_family = AF_INET6;
+        mapped.sin6_port = sin->sin_port;
+        mapped.sin6_addr.s6_addr[10] = mapped.sin6_addr.s6_addr[11] = 0xff;
+        memcpy(&mapped.sin6_addr.s6_addr[12], &sin->sin_addr, 4);
+
+        sa = (const struct sockaddr*)&mapped;
+        len = sizeof(mapped);
+    }
+
+    if(len > sizeof(sockaddr_t) || (relay->remote_sa_len == len && memcmp(&relay->remote_sa, sa, len) == 0)) return;
+
+    memcpy(&relay->remote_sa, sa, len);
+    relay->remote_sa_len = len;
+    relay->mtu = relay->mtu_limit;
+    relay->mtu_time = time_usec();
+
+    syslog(LOG_INFO, "%s resolved to %s", relay->remote_addr, relay_remote_sa(relay));
+
+    /* Route to new address may leave through another interface */
+    if(relay->txtime != TXTIME_QUEUE) relay_setsockopts(relay);
+}
+
+bool relay_congested(relay_t *relay) {
+    /* Datagrams held back by offset are not a backlog */
+    if(!relay_queued(relay)) return false;
+
+    uint64_t due = relay_head_due(relay);
+    return !due || due <= time_usec();
+}
+
+static void relay_refill(relay_t *relay, uint64_t now) {
+    if(!relay->rate || now <= relay->tokens_time) {
+        relay->tokens_time = MAX(relay->tokens_time, now);
+        return;
+    }
+
+    relay->tokens += (double)(now - relay->tokens_time) * relay->rate / 1000000;
+    if(relay->tokens > relay->burst) relay->tokens = relay->burst;
+    relay->tokens_time = now;
+}
+
+/* Check if datagram of given length conforms to rate limit */
+static bool relay_tokens(relay_t *relay, size_t length) {
+    if(!relay->rate) return true;
+
+    relay_refill(relay, time_usec());
+    /* Datagrams larger than bucket depth require full bucket */
+    return relay->tokens >= MIN(length, relay->burst);
+}
+
+static void relay_consume(relay_t *relay, size_t length) {
+    if(relay->rate) relay->tokens -= length;
+}
+
+static size_t relay_head_length(relay_t *relay) {
+    return relay->send_size ? relay->send_size : (relay->queue ? relay->queue->length : 0);
+}
+
+static uint64_t relay_head_due(relay_t *relay) {
+    return relay->send_size ? relay->send_due : (relay->queue ? relay->queue->due : 0);
+}
+
+/* Head of send queue may be sent now */
+static bool relay_ready(relay_t *relay) {
+    uint64_t due = relay_head_due(relay);
+    return (!due || due <= time_usec()) && relay_tokens(relay, relay_head_length(relay));
+}
+
+static int64_t until(uint64_t deadline, uint64_t now) {
+    return deadline > now ? (int64_t)(deadline - now) : 0;
+}
+
+/* Microseconds left until next state transition or until head of send queue may be sent, or -1 */
+int64_t relay_timeout(relay_t *relay, uint64_t now) {
+    int64_t timeout = -1;
+
+    if(relay->state == RELAY_DOWN) {
+        return until(relay->retry_time, now);
+    } else if(relay->state != RELAY_UP) {
+        timeout = MIN(until(relay->probe_time + PROBE_USEC, now), until(relay->state_time + DOWN_USEC, now));
+    }
+
+    if(!relay_queued(relay)) return timeout;
+
+    /* Head is held back by offset */
+    uint64_t due = relay_head_due(relay);
+    if(due > now) return timeout < 0 ? until(due, now) : MIN(timeout, until(due, now));
+
+    if(!relay->rate) return timeout;
+
+    relay_refill(relay, now);
+
+    double need = MIN(relay_head_length(relay), relay->burst) - relay->tokens;
+    int64_t t = need > 0 ? (int64_t)(need * 1000000 / relay->rate) + 1 : 0;
+
+    return timeout < 0 ? t : MIN(timeout, t);
+}
+
 void relay_fd_set(relay_t *relay, fd_set *rfds, fd_set *wfds) {
-    if(relay_queued(relay)) FD_SET(relay->fd, wfds);
+    if(relay->fd < 0) return;
+
+    if(relay_queued(relay) && relay_ready(relay)) FD_SET(relay->fd, wfds);
     if(!relay->recv_size) FD_SET(relay->fd, rfds);
 }
 
 ssize_t relay_enqueue(relay_t *relay, const void *buffer, size_t length) {
-    if(!relay->remote_sa_len) {
+    if(relay->fd < 0 || (!relay->remote_sa_len && !relay->tun)) {
         /* Drop */
         return 0;
     }
 
-    /* Try to send immediately.  */
-    ssize_t sz = sendto(relay->fd, buffer, length, 0, &relay->remote_sa.sa, relay->remote_sa_len);
-    if(sz > 0) return 0;
+    relay->send_time = time_usec();
 
-    if(X_UNLIKELY(sz < 0 && (errno == EMSGSIZE || errno == EHOSTUNREACH || errno == ENETUNREACH))) {
-        syslog(LOG_WARNING, "%s: %m", relay_remote_sa(relay));
-        return 0;
-    }
+    /* Copy is held back by offset unless qdisc does it */
+    uint64_t due = relay->offset && !relay->txtime_on ? relay->send_time + relay->offset : 0;
 
-    if(X_UNLIKELY(!sz || (sz < 0 && errno != EAGAIN))) {
-        if(sz < 0) syslog(LOG_ERR, "%s: %m", relay_remote_sa(relay));
-        return -1;
-    }
+    /* Try to send immediately if nothing is waiting and rate allows */
+    if(!relay_queued(relay) && !due && relay_tokens(relay, length)) {
+        ssize_t sz = relay_sendto(relay, buffer, length);
+        if(sz > 0) {
+            relay_consume(relay, sz);
+            return 0;
+        }
+
+        /* syslog() may clobber errno */
+        int err = errno;
+        if(X_UNLIKELY(sz < 0 && (err == EMSGSIZE || err == EHOSTUNREACH || err == ENETUNREACH))) {
+            syslog(LOG_WARNING, "%s: %m", relay_remote_sa(relay));
+            if(err == EMSGSIZE) relay_update_mtu(relay);
+            else relay_suspect(relay);
+            return 0;
+        }
 
-    /* errno == EAGAIN */
-    (void)X_LIKELY(errno == EAGAIN);
+        if(X_UNLIKELY(!sz || (sz < 0 && errno != EAGAIN))) {
+            if(sz < 0) syslog(LOG_ERR, "%s: %m", relay_remote_sa(relay));
+            return -1;
+        }
+
+        /* errno == EAGAIN */
+        (void)X_LIKELY(errno == EAGAIN);
+    }
 
     /* Add to queue */
     if(relay_queued(relay)) {
         X_DBG("queued\n");
-        queue_t *item = malloc(sizeof(queue_t));
-        item->buffer = malloc(length);
+        queue_t *item;
+
+        if(relay->queue_limit && relay->queue_len >= relay->queue_limit) {
+            /* Queue is full, drop the oldest datagram and reuse its item */
+            item = relay->queue;
+            CLIST_DEL(relay->queue, item);
+            relay->queue_len--;
+            relay->dropped++;
+
+            if(item->length < length) item->buffer = realloc(item->buffer, length);
+        } else {
+            item = malloc(sizeof(queue_t));
+            item->buffer = malloc(length);
+        }
+
         memcpy(item->buffer, buffer, length);
         item->length = length;
+        item->due = due;
 
         CLIST_ADD_LAST(relay->queue, item);
+        relay->queue_len++;
     } else {
         X_DBG("buffered\n");
         if(!relay->send_buffer) {
@@ -287,11 +1034,22 @@ ssize_t relay_enqueue(relay_t *relay, const void *buffer, size_t length) {
 
         memcpy(relay->send_buffer, buffer, length);
         relay->send_size = length;
+        relay->send_due = due;
     }
 
     return 0;
 }
 
+/* Datagram just received comes from peer: bring relay up and follow peer's address */
+void relay_accept(relay_t *relay) {
+    if(relay->state != RELAY_UP) relay_set_state(relay, RELAY_UP, relay->recv_time);
+
+    if(relay->dynamic_out_addr) {
+        memcpy(&relay->remote_sa, &relay->recv_sa, relay->recv_sa_len);
+        relay->remote_sa_len = relay->recv_sa_len;
+    }
+}
+
 /* Returns pointer to internal buffer! */
 ssize_t relay_receive(relay_t *relay, void **buffer) {
     if(!relay->recv_size) return 0;
@@ -303,6 +1061,8 @@ ssize_t relay_receive(relay_t *relay, void **buffer) {
 }
 
 int relay_handle(relay_t *relay, const fd_set *rfds, const fd_set *wfds) {
+    if(relay->fd < 0) return 0;
+
     /* Read event */
     if(FD_ISSET(relay->fd, rfds) && !relay->recv_size) {
         if(!relay->recv_buffer) {
@@ -311,13 +1071,15 @@ int relay_handle(relay_t *relay, const fd_set *rfds, const fd_set *wfds) {
 
         sockaddr_t sa;
         socklen_t salen = sizeof(sockaddr_t);
+        uint64_t stamp = 0;
 
-        ssize_t sz = recvfrom(relay->fd, relay->recv_buffer, BUF_SZ, 0, &sa.sa, &salen);
+        ssize_t sz = relay_recvfrom(relay, relay->recv_buffer, BUF_SZ, &sa, &salen, &stamp);
 
         if(sz < 0 && (errno == EAGAIN || errno == EHOSTUNREACH || errno == ENETUNREACH)) {
             /* Skip */
             if(X_UNLIKELY(errno != EAGAIN)) {
                 syslog(LOG_WARNING, "%s: %m", relay_remote_sa(relay));
+                relay_suspect(relay);
             }
 
         } else if(X_UNLIKELY(sz <= 0)) {
@@ -326,11 +1088,11 @@ int relay_handle(relay_t *relay, const fd_set *rfds, const fd_set *wfds) {
 
         } else {
             relay->recv_size = sz;
-            /* Update out address */
-            if(relay->dynamic_out_addr) {
-                memcpy(&relay->remote_sa, &sa, salen);
-                relay->remote_sa_len = salen;
-            }
+            relay->recv_time = stamp ? stamp : time_usec();
+
+            /* Peer state and address are updated by relay_accept() once datagram is known to be genuine */
+            memcpy(&relay->recv_sa, &sa, salen);
+            relay->recv_sa_len = salen;
             X_DBG("Recv from ");
             dump_sockaddr(&sa.sa);
         }
@@ -338,15 +1100,20 @@ int relay_handle(relay_t *relay, const fd_set *rfds, const fd_set *wfds) {
 
     /* Write event */
     if(FD_ISSET(relay->fd, wfds)) {
+        if(!relay_ready(relay)) return 0;
+
         if(relay->send_size) {
-            ssize_t sz = sendto(relay->fd, relay->send_buffer, relay->send_size, 0,
-                &relay->remote_sa.sa, relay->remote_sa_len);
+            ssize_t sz = relay_sendto(relay, relay->send_buffer, relay->send_size);
+            int err = errno;
 
-            if(sz > 0 || (sz < 0 && (errno == EAGAIN || errno == EMSGSIZE ||
-                                    errno == EHOSTUNREACH || errno == ENETUNREACH))) {
+            if(sz > 0 || (sz < 0 && (err == EAGAIN || err == EMSGSIZE ||
+                                    err == EHOSTUNREACH || err == ENETUNREACH))) {
 
-                if(sz > 0 || X_UNLIKELY(sz < 0 && errno != EAGAIN)) {
+                if(sz > 0 || X_UNLIKELY(sz < 0 && err != EAGAIN)) {
                     if(sz < 0) syslog(LOG_WARNING, "%s: %m", relay_remote_sa(relay));
+                    else relay_consume(relay, sz);
+                    if(sz < 0 && err == EMSGSIZE) relay_update_mtu(relay);
+                    else if(sz < 0) relay_suspect(relay);
                     relay->send_size = 0;
                 }
 
@@ -359,16 +1126,20 @@ int relay_handle(relay_t *relay, const fd_set *rfds, const fd_set *wfds) {
         } else if(relay->queue) {
             queue_t *item = relay->queue;
 
-            ssize_t sz = sendto(relay->fd, item->buffer, item->length, 0,
-                &relay->remote_sa.sa, relay->remote_sa_len);
+            ssize_t sz = relay_sendto(relay, item->buffer, item->length);
+            int err = errno;
 
-            if(sz > 0 || (sz < 0 && (errno == EAGAIN || errno == EMSGSIZE ||
-                                    errno == EHOSTUNREACH || errno == ENETUNREACH))) {
+            if(sz > 0 || (sz < 0 && (err == EAGAIN || err == EMSGSIZE ||
+                                    err == EHOSTUNREACH || err == ENETUNREACH))) {
 
-                if(sz > 0 || X_UNLIKELY(sz < 0 && errno != EAGAIN)) {
+                if(sz > 0 || X_UNLIKELY(sz < 0 && err != EAGAIN)) {
                     if(sz < 0) syslog(LOG_WARNING, "%s: %m", relay_remote_sa(relay));
+                    else relay_consume(relay, sz);
+                    if(sz < 0 && err == EMSGSIZE) relay_update_mtu(relay);
+                    else if(sz < 0) relay_suspect(relay);
 
                     CLIST_DEL(relay->queue, item);
+                    relay->queue_len--;
                     free(item->buffer);
                     free(item);
                 }
@@ -382,4 +1153,22 @@ int relay_handle(relay_t *relay, const fd_set *rfds, const fd_set *wfds) {
     }
 
     return 0;
-}
\ No newline at end of file
+}
+
+const relay_io_t relay_socket_io = {
+    .open = socket_open,
+    .close = fd_close,
+    .route = socket_reroute,
+    .setsockopts = socket_setsockopts,
+    .pacing = socket_pacing,
+    .path_mtu = socket_path_mtu,
+    .sendto = socket_sendto,
+    .recvfrom = socket_recvfrom,
+};
+
+const relay_io_t relay_tun_io = {
+    .open = tun_open,
+    .close = fd_close,
+    .sendto = tun_write,
+    .recvfrom = tun_read,
+};
@@ -2,6 +2,7 @@
 #define RELAY_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/select.h>
@@ -10,48 +11,180 @@
 
 #include "config.h"
 #include "clist.h"
+#include "cc.h"
+#include "capture.h"
+#include "aead.h"
 
 typedef struct _relay_t relay_t;
 typedef struct _queue_t queue_t;
+typedef struct _relay_io_t relay_io_t;
+
+typedef enum {
+    RELAY_UP = 0,
+    RELAY_SUSPECT,  /* Transient errors or peer is silent, probing while carrying traffic */
+    RELAY_DOWN,     /* Socket is closed, waiting to be reopened */
+    RELAY_PROBING,  /* Reopened, waiting for peer to answer probes */
+} relay_state_t;
 
 typedef union {
     struct sockaddr sa;
     struct sockaddr_storage _storage;
 } sockaddr_t;
 
+/* Datagram I/O behind relays: sockets, TUN device or a simulated network.
+   Optional operations may be NULL */
+struct _relay_io_t {
+    /* Set fd, resolve and bind addresses */
+    int (*open)(relay_t *relay);
+    void (*close)(relay_t *relay);
+    /* Optional: apply device, fwmark and tos after change */
+    int (*route)(relay_t *relay);
+    /* Optional: apply MTU discovery, pacing rate and other socket options */
+    void (*setsockopts)(relay_t *relay);
+    /* Optional: apply only pacing rate, called on every rate change */
+    void (*pacing)(relay_t *relay);
+    /* Optional: path MTU to remote address, 0 if unknown */
+    size_t (*path_mtu)(relay_t *relay);
+    /* Same semantics as sendto() and recvfrom() on non-blocking socket.
+       recvfrom sets stamp to arrival time in time_usec() clock if it is known */
+    ssize_t (*sendto)(relay_t *relay, const void *buffer, size_t length);
+    ssize_t (*recvfrom)(relay_t *relay, void *buffer, size_t size, sockaddr_t *sa, socklen_t *salen, uint64_t *stamp);
+};
+
+extern const relay_io_t relay_socket_io;
+extern const relay_io_t relay_tun_io;
+
 struct _relay_t {
     int fd;
+    const relay_io_t *io;
+
+    relay_state_t state;
+    uint64_t state_time;
+    /* Arrival of last datagram, taken by kernel where supported */
+    uint64_t recv_time;
+    uint64_t send_time;
+    uint64_t probe_time;
+    uint64_t retry_time;
+    uint64_t backoff;
 
     sockaddr_t remote_sa;
     socklen_t remote_sa_len;
     char remote_sa_buf[INET6_ADDRSTRLEN];
 
+    int family;
+
     /* Update remote_sa on every incoming packet with its source address */
     bool dynamic_out_addr;
 
+    /* IPv6 socket reaching IPv4 addresses as mapped ones, remote host name is of unknown family */
+    bool v4mapped;
+
+    /* fd is TUN device named local_addr */
+    bool tun;
+
+    /* Packet capture, NULL if off */
+    capture_t *capture;
+    int capture_if;
+
     char *local_addr;
     char *remote_addr;
 
+    /* Egress interface, firewall mark and IP TOS / traffic class */
+    char *device;
+    uint32_t fwmark;
+    int tos;
+
+    /* Busy poll device queue for up to N usec when receive queue is empty (0 = disabled) */
+    int busy_poll;
+    bool busy_poll_reset;
+
+    /* eBPF socket filter program to attach and one attached to current socket (-1 = none) */
+    int filter;
+    int filter_attached;
+
+    /* Socket buffer sizes (0 = system default) */
+    int rcvbuf;
+    int sndbuf;
+
+    /* Datagrams leave offset usec after being sent, scheduled by qdisc if socket
+       accepted SO_TXTIME and the qdisc is there, otherwise held in send queue until due */
+    uint32_t offset;
+    txtime_t txtime;
+    bool txtime_on;
+    bool txtime_no_qdisc;
+
+    /* Scheduling: weight, smooth weighted round-robin state, position in config */
+    int weight;
+    int wrr_current;
+    int order;
+
+    /* Remote host name is re-resolved asynchronously at resolve_time (0 = as soon as possible) */
+    bool resolve;
+    bool resolving;
+    uint64_t resolve_time;
+    uint64_t resolve_id;
+
     queue_t *queue;
+    int queue_len;
+    int queue_limit;
+    unsigned long dropped;
+
+    /* Token bucket pacing, rate in bytes per second (0 = unlimited) */
+    uint64_t rate;
+    size_t burst;
+    size_t burst_limit;
+    double tokens;
+    uint64_t tokens_time;
 
     /* Reusable buffer for 1st item in send queue */
     void *send_buffer;
     size_t send_buffer_size;
     size_t send_size;
+    uint64_t send_due;
+
+    /* Path MTU: current datagram size limit, configured limit (0 = no limit) and time of last change */
+    size_t mtu;
+    size_t mtu_limit;
+    uint64_t mtu_time;
+
+    /* Congestion control */
+    cc_t cc;
+    uint16_t pseq;
+
+    /* Per-path MAC is bound to path number, window of path counters received with it */
+    uint32_t path;
+    aead_window_t path_window;
 
-    /* Receive buffer */
+    /* Receive buffer and source address of datagram in it */
     void *recv_buffer;
     size_t recv_size;
+    sockaddr_t recv_sa;
+    socklen_t recv_sa_len;
 
     relay_t *_prev;
     relay_t *_next;
 };
 
 relay_t *new_relay(const relay_config_t *config);
+relay_t *new_tun_relay(const char *name);
 void free_relay(relay_t *relay);
+void relay_configure(relay_t *relay, const relay_config_t *config);
+void relay_down(relay_t *relay);
+void relay_accept(relay_t *relay);
+bool relay_active(relay_t *relay);
+bool relay_update(relay_t *relay, uint64_t now);
 ssize_t relay_enqueue(relay_t *relay, const void *buffer, size_t length);
 ssize_t relay_receive(relay_t *relay, void **buffer);
 int relay_handle(relay_t *relay, const fd_set *rfds, const fd_set *wfds);
 void relay_fd_set(relay_t *relay, fd_set *rfds, fd_set *wfds);
+int64_t relay_timeout(relay_t *relay, uint64_t now);
+void relay_set_rate(relay_t *relay, uint64_t rate);
+bool relay_congested(relay_t *relay);
+void relay_set_mtu(relay_t *relay, size_t mtu);
+void relay_set_busy_poll(relay_t *relay, int usec);
+void relay_set_filter(relay_t *relay, int prog_fd);
+size_t relay_mtu(relay_t *relay);
+void relay_set_remote(relay_t *relay, const struct sockaddr *sa, socklen_t len);
+void relay_set_io(const relay_io_t *io);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,211 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Eugene Zagidullin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/*
+Asynchronous getaddrinfo(). Requests are served by a small pool of threads, so
+lookups of different hosts run in parallel and never block the event loop.
+Completion is signalled through a pipe which the event loop watches.
+Threads are started on demand, so it's safe to fork after new_resolver().
+They are detached: free_resolver() doesn't wait for a lookup stuck in DNS
+timeouts, the last thread to finish frees the resolver instead.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <netdb.h>
+
+#include "resolver.h"
+#include "utils.h"
+#include "clist.h"
+#include "debug.h"
+
+typedef struct _request_t request_t;
+
+struct _request_t {
+    char *host;
+    char *service;
+    int family;
+
+    resolver_result_t result;
+
+    request_t *_prev;
+    request_t *_next;
+};
+
+struct _resolver_t {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool stop;
+
+    request_t *pending;
+    request_t *done;
+
+    /* Running threads */
+    int threads_num;
+    int threads_max;
+    int idle;
+
+    /* Notification pipe */
+    int pipe_fd[2];
+};
+
+static void free_request(request_t *req) {
+    free(req->host);
+    free(req);
+}
+
+static void resolver_destroy(resolver_t *res) {
+    request_t *req;
+    while((req = res->pending) != NULL) {
+        CLIST_DEL(res->pending, req);
+        free_request(req);
+    }
+    while((req = res->done) != NULL) {
+        CLIST_DEL(res->done, req);
+        free_request(req);
+    }
+
+    close(res->pipe_fd[0]);
+    close(res->pipe_fd[1]);
+    pthread_mutex_destroy(&res->lock);
+    pthread_cond_destroy(&res->cond);
+    free(res);
+}
+
+static void *resolver_thread(void *arg) {
+    resolver_t *res = arg;
+
+    pthread_mutex_lock(&res->lock);
+    while(1) {
+        res->idle++;
+        while(!res->stop && !res->pending) pthread_cond_wait(&res->cond, &res->lock);
+        res->idle--;
+        if(res->stop) break;
+
+        request_t *req = res->pending;
+        CLIST_DEL(res->pending, req);
+        pthread_mutex_unlock(&res->lock);
+
+        struct addrinfo hints, *ai;
+        memset(&hints, 0, sizeof(struct addrinfo));
+        hints.ai_family = req->family;
+        hints.ai_socktype = SOCK_DGRAM;
+
+        X_DBG("Resolving %s:%s\n", req->host, req->service);
+        if((req->result.err = getaddrinfo(req->host, req->service, &hints, &ai)) == 0) {
+            memcpy(&req->result.addr, ai->ai_addr, ai->ai_addrlen);
+            req->result.addr_len = ai->ai_addrlen;
+            freeaddrinfo(ai);
+        }
+
+        pthread_mutex_lock(&res->lock);
+        CLIST_ADD_LAST(res->done, req);
+        if(res->stop) break;
+        write(res->pipe_fd[1], "", 1);
+    }
+    bool last = !--res->threads_num && res->stop;
+    pthread_mutex_unlock(&res->lock);
+
+    if(last) resolver_destroy(res);
+    return NULL;
+}
+
+resolver_t *new_resolver(int threads) {
+    resolver_t *res = calloc(1, sizeof(resolver_t));
+
+    if(pipe(res->pipe_fd) < 0) {
+        free(res);
+        return NULL;
+    }
+
+    int i;
+    for(i = 0; i < 2; i++) {
+        fcntl(res->pipe_fd[i], F_SETFL, fcntl(res->pipe_fd[i], F_GETFL, 0) | O_NONBLOCK);
+        fcntl(res->pipe_fd[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    pthread_mutex_init(&res->lock, NULL);
+    pthread_cond_init(&res->cond, NULL);
+
+    res->threads_max = threads;
+
+    return res;
+}
+
+/* Doesn't wait for lookups in progress, their results are dropped */
+void free_resolver(resolver_t *res) {
+    pthread_mutex_lock(&res->lock);
+    res->stop = true;
+    pthread_cond_broadcast(&res->cond);
+    bool last = !res->threads_num;
+    pthread_mutex_unlock(&res->lock);
+
+    if(last) resolver_destroy(res);
+}
+
+/* Readable when results are available */
+int resolver_fd(resolver_t *res) {
+    return res->pipe_fd[0];
+}
+
+/* Resolve "host:port". ctx and id are returned with result */
+void resolver_submit(resolver_t *res, const char *addr, int family, void *ctx, uint64_t id) {
+    request_t *req = calloc(1, sizeof(request_t));
+
+    req->host = xstrdup(addr);
+    if((req->service = strchr(req->host, ':')) != NULL) *(req->service++) = '\0';
+    req->family = family;
+    req->result.ctx = ctx;
+    req->result.id = id;
+
+    pthread_mutex_lock(&res->lock);
+    CLIST_ADD_LAST(res->pending, req);
+    pthread_t thread;
+    if(!res->idle && res->threads_num < res->threads_max && pthread_create(&thread, NULL, resolver_thread, res) == 0) {
+        pthread_detach(thread);
+        res->threads_num++;
+    }
+    pthread_cond_signal(&res->cond);
+    pthread_mutex_unlock(&res->lock);
+}
+
+/* Fetch one completed request, returns false if there are none */
+bool resolver_result(resolver_t *res, resolver_result_t *result) {
+    char buf[64];
+    while(read(res->pipe_fd[0], buf, sizeof(buf)) > 0);
+
+    pthread_mutex_lock(&res->lock);
+    request_t *req = res->done;
+    if(req) CLIST_DEL(res->done, req);
+    pthread_mutex_unlock(&res->lock);
+
+    if(!req) return false;
+
+    *result = req->result;
+    free_request(req);
+    return true;
+}
@@ -0,0 +1,28 @@
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+typedef struct _resolver_t resolver_t;
+typedef struct _resolver_result_t resolver_result_t;
+
+struct _resolver_result_t {
+    void *ctx;
+    uint64_t id;
+
+    /* getaddrinfo() error code, 0 on success */
+    int err;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+};
+
+resolver_t *new_resolver(int threads);
+void free_resolver(resolver_t *res);
+int resolver_fd(resolver_t *res);
+void resolver_submit(resolver_t *res, const char *addr, int family, void *ctx, uint64_t id);
+bool resolver_result(resolver_t *res, resolver_result_t *result);
+
+#endif
@@ -24,11 +24,15 @@ SOFTWARE.
 
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 
 #include "seen_lookup.h"
 #include "sglib.h"
 #include "clist.h"
 
+/* Sequence numbers are 16 bit, items must span much less than that to be told apart */
+#define MAX_ITEMS 16384
+
 typedef struct _lookup_item_t lookup_item_t;
 
 struct _lookup_t {
@@ -46,10 +50,22 @@ struct _lookup_t {
 	lookup_item_t *tree;
 
 	int items;
+
+	/* Minimal number of items and time to keep each item (0 = count only) */
+	int size;
+	uint64_t window;
+
+	/* Newest sequence number pushed out of window and when it happened */
+	int floor;
+	uint64_t floor_time;
+	bool has_floor;
+
+	unsigned long late;
 };
 
 struct _lookup_item_t {
 	int seq;
+	uint64_t time;
 
 	/* RB-tree */
 	int _color;
@@ -66,50 +82,140 @@ struct _lookup_item_t {
 SGLIB_DEFINE_RBTREE_PROTOTYPES(lookup_item_t, _left, _right, _color, LU_COMPARATOR);
 SGLIB_DEFINE_RBTREE_FUNCTIONS(lookup_item_t, _left, _right, _color, LU_COMPARATOR);
 
-lookup_t *new_lookup(int size) {
-	lookup_t *lu = calloc(1, sizeof(lookup_t));
+/* Serial number arithmetic: how far a is behind b */
+static int seq_behind(int a, int b) {
+	return (int16_t)(uint16_t)(b - a);
+}
 
-	lu->pool = calloc(size, sizeof(lookup_item_t));
-	lu->pool_size = size;
+static void lookup_init_pool(lookup_t *lu, int pool_size) {
+	lu->pool = calloc(pool_size, sizeof(lookup_item_t));
+	lu->pool_size = pool_size;
+	lu->free_items = NULL;
+	lu->list = NULL;
+	lu->tree = NULL;
+	lu->items = 0;
 
 	/* Initialize pool */
 	int i;
 	for(i = 0; i < lu->pool_size; i++) {
 		CLIST_ADD_LAST(lu->free_items, &lu->pool[i]);
 	}
+}
+
+static void lookup_insert(lookup_t *lu, int seq, uint64_t now) {
+	lookup_item_t *item = lu->free_items;
+	CLIST_DEL(lu->free_items, item);
+
+	item->seq = seq;
+	item->time = now;
+	CLIST_ADD_LAST(lu->list, item);
+	sglib_lookup_item_t_add(&lu->tree, item);
+	lu->items++;
+}
+
+static void lookup_evict(lookup_t *lu, uint64_t now) {
+	lookup_item_t *item = lu->list;
+	CLIST_DEL(lu->list, item);
+	sglib_lookup_item_t_delete(&lu->tree, item);
+	CLIST_ADD_LAST(lu->free_items, item);
+	lu->items--;
+
+	if(lu->window) {
+		if(!lu->has_floor || seq_behind(lu->floor, item->seq) > 0) lu->floor = item->seq;
+		lu->floor_time = now;
+		lu->has_floor = true;
+	}
+}
+
+/* Move most recent items to pool of another size */
+static void lookup_repool(lookup_t *lu, int pool_size) {
+	lookup_item_t *old_pool = lu->pool, *old_list = lu->list;
+	int skip = lu->items - pool_size;
+
+	lookup_init_pool(lu, pool_size);
+
+	lookup_item_t *item;
+	CLIST_FOREACH(item, old_list) {
+		if(skip-- > 0) continue;
+		lookup_insert(lu, item->seq, item->time);
+	}
 
+	free(old_pool);
+}
+
+lookup_t *new_lookup(int size) {
+	lookup_t *lu = calloc(1, sizeof(lookup_t));
+	lu->size = size;
+	lookup_init_pool(lu, size);
 	return lu;
 }
 
-/* return true if added */
-bool lookup_push(lookup_t *lu, int seq) {
+/* Keep every item for at least window usec, growing with traffic rate */
+void lookup_set_window(lookup_t *lu, uint64_t window) {
+	if(window == lu->window) return;
+
+	lu->window = window;
+	lu->has_floor = false;
+}
+
+/* return true if seen recently */
+bool lookup_seen(lookup_t *lu, int seq) {
+	return sglib_lookup_item_t_find_member(lu->tree, &(lookup_item_t){.seq = seq}) != NULL;
+}
+
+/* return true if added, false for duplicates and copies too late to be told from duplicates */
+bool lookup_push(lookup_t *lu, int seq, uint64_t now) {
 	/* Already seen recently */
-	if(sglib_lookup_item_t_find_member(lu->tree, &(lookup_item_t){.seq = seq})) {
+	if(lookup_seen(lu, seq)) {
 		return false;
 	}
 
-	lookup_item_t *item;
-	if(lu->items == lu->pool_size) {
-		/* Remove first item and reuse it */
-		item = lu->list;
-		CLIST_DEL(lu->list, item);
-		sglib_lookup_item_t_delete(&lu->tree, item);
-		lu->items--;
-	} else {
-		/* get first free */
-		item = lu->free_items;
-		CLIST_DEL(lu->free_items, item);
+	if(lu->window) {
+		/* Expire items which are out of window, but keep at least size of them */
+		while(lu->items > lu->size && now - lu->list->time >= lu->window) lookup_evict(lu, now);
+
+		/* Rate dropped */
+		if(lu->pool_size > lu->size && lu->items < lu->pool_size / 4) lookup_repool(lu, lu->pool_size / 2);
+
+		/* Older than anything forgotten recently, so its first copy could have been forgotten too */
+		if(lu->has_floor && now - lu->floor_time < lu->window) {
+			int behind = seq_behind(seq, lu->floor);
+			if(behind >= 0 && behind < MAX_ITEMS) {
+				lu->late++;
+				return false;
+			}
+		}
+
+		/* Window holds more than pool, grow */
+		if(lu->items == lu->pool_size && now - lu->list->time < lu->window && lu->pool_size < MAX_ITEMS) {
+			lookup_repool(lu, lu->pool_size * 2 < MAX_ITEMS ? lu->pool_size * 2 : MAX_ITEMS);
+		}
 	}
 
-	item->seq = seq;
-	CLIST_ADD_LAST(lu->list, item);
-	sglib_lookup_item_t_add(&lu->tree, item);
-	lu->items++;
+	/* Remove first item and reuse it */
+	if(lu->items == lu->pool_size) lookup_evict(lu, now);
+
+	lookup_insert(lu, seq, now);
 
 	return true;
 }
 
+/* Change minimal number of items keeping most recent items */
+lookup_t *lookup_resize(lookup_t *lu, int size) {
+	if(size == lu->size) return lu;
+
+	lu->size = size;
+	if(size > lu->pool_size || !lu->window) lookup_repool(lu, size);
+
+	return lu;
+}
+
+/* Datagrams dropped as too late */
+unsigned long lookup_late(lookup_t *lu) {
+	return lu->late;
+}
+
 void free_lookup(lookup_t *lu) {
 	free(lu->pool);
 	free(lu);
-}
\ No newline at end of file
+}
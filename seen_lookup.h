@@ -2,11 +2,16 @@
 #define SEEN_LOOKUP_H
 
 #include <stdbool.h>
+#include <stdint.h>
 
 typedef struct _lookup_t lookup_t;
 
 lookup_t *new_lookup(int size);
-bool lookup_push(lookup_t *lu, int seq);
+void lookup_set_window(lookup_t *lu, uint64_t window);
+bool lookup_push(lookup_t *lu, int seq, uint64_t now);
+bool lookup_seen(lookup_t *lu, int seq);
+lookup_t *lookup_resize(lookup_t *lu, int size);
+unsigned long lookup_late(lookup_t *lu);
 void free_lookup(lookup_t *lu);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,189 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Eugene Zagidullin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/*
+Duplicate filter safe to use from several threads at once.
+
+Sequence numbers are partitioned between shards by seq % shards. Every shard
+keeps its own window of slots on its own cache lines, so threads handling
+different shards never touch the same memory. Within a shard a slot holds the
+extended (unwrapped) sequence number last recorded in it, and a datagram is
+accepted by compare-and-swap of the slot, so exactly one of the threads
+racing with copies of the same datagram wins it.
+
+As in seen_lookup.c a datagram older than the window is dropped as late only
+while its shard keeps accepting newer ones. When nothing new came for a whole
+time window the peer must have restarted its sequence numbers, so the shard
+moves its extended numbers forward by a full wrap and starts over from there
+instead of dropping everything until the new numbers catch up.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "shard_lookup.h"
+
+#define CACHE_LINE 64
+
+/* Sequence numbers are 16 bit, window must span much less than that to be told apart */
+#define MAX_WINDOW 16384
+#define MAX_SHARDS 64
+
+/* Extended sequence numbers start here, so unwrapping backwards never goes below zero */
+#define EXT_BASE ((uint64_t)1 << 32)
+
+typedef struct {
+	/* Newest extended sequence number + 1, 0 if none yet */
+	uint64_t head;
+	unsigned long late;
+
+	/* When the shard accepted a datagram last time */
+	uint64_t head_time;
+
+	/* Extended sequence number + 1 of the last datagram recorded in the slot */
+	uint64_t *slots;
+} __attribute__((aligned(CACHE_LINE))) shard_t;
+
+struct _shard_lookup_t {
+	shard_t *shards;
+	int shift;
+	uint64_t shard_mask;
+	uint64_t slot_mask;
+	uint64_t *slots;
+
+	/* Time to keep dropping late datagrams after the last accepted one (0 = forever) */
+	uint64_t window;
+};
+
+/* Nearest to the shard's newest one extended sequence number of seq */
+static uint64_t shard_unwrap(shard_t *sh, int seq) {
+	uint64_t head = __atomic_load_n(&sh->head, __ATOMIC_RELAXED);
+	if(!head) return EXT_BASE + (uint16_t)seq;
+
+	head--;
+	return head + (int16_t)(uint16_t)(seq - (uint16_t)head);
+}
+
+/* size is the number of recent sequence numbers to keep, shards is rounded up to power of 2 */
+shard_lookup_t *new_shard_lookup(int size, int shards) {
+	if(size > MAX_WINDOW) size = MAX_WINDOW;
+	if(shards > MAX_SHARDS) shards = MAX_SHARDS;
+
+	shard_lookup_t *sl = calloc(1, sizeof(shard_lookup_t));
+	if(!sl) return NULL;
+
+	while((1 << sl->shift) < shards) sl->shift++;
+	shards = 1 << sl->shift;
+	sl->shard_mask = shards - 1;
+
+	/* Shard's window is a power of 2 too, so the slot of seq doesn't change with wrap */
+	int window = 1;
+	while(window * shards < size) window *= 2;
+	sl->slot_mask = window - 1;
+
+	if(posix_memalign((void**)&sl->shards, CACHE_LINE, shards * sizeof(shard_t)) ||
+		posix_memalign((void**)&sl->slots, CACHE_LINE, (size_t)shards * window * sizeof(uint64_t))) {
+
+		free(sl->shards);
+		free(sl);
+		return NULL;
+	}
+
+	memset(sl->shards, 0, shards * sizeof(shard_t));
+	memset(sl->slots, 0, (size_t)shards * window * sizeof(uint64_t));
+
+	int i;
+	for(i = 0; i < shards; i++) sl->shards[i].slots = sl->slots + (size_t)i * window;
+
+	return sl;
+}
+
+/* Shard seq belongs to, threads owning distinct shards don't contend */
+int shard_lookup_shard(shard_lookup_t *sl, int seq) {
+	return (uint16_t)seq & sl->shard_mask;
+}
+
+int shard_lookup_shards(shard_lookup_t *sl) {
+	return sl->shard_mask + 1;
+}
+
+/* Treat late datagrams as restart of the peer after window usec without new ones */
+void shard_lookup_set_window(shard_lookup_t *sl, uint64_t window) {
+	sl->window = window;
+}
+
+/* return true if seen recently */
+bool shard_lookup_seen(shard_lookup_t *sl, int seq) {
+	shard_t *sh = &sl->shards[shard_lookup_shard(sl, seq)];
+	uint64_t ext = shard_unwrap(sh, seq);
+
+	return __atomic_load_n(&sh->slots[(ext >> sl->shift) & sl->slot_mask], __ATOMIC_ACQUIRE) == ext + 1;
+}
+
+/* return true if added, false for duplicates and datagrams older than the window */
+bool shard_lookup_push(shard_lookup_t *sl, int seq, uint64_t now) {
+	shard_t *sh = &sl->shards[shard_lookup_shard(sl, seq)];
+	uint64_t ext = shard_unwrap(sh, seq);
+	uint64_t *slot = &sh->slots[(ext >> sl->shift) & sl->slot_mask];
+
+	uint64_t v = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+	do {
+		/* Another copy won */
+		if(v == ext + 1) return false;
+
+		/* Slot was reused by a newer datagram, first copy could have been forgotten */
+		if(v > ext + 1) {
+			if(!sl->window || now - __atomic_load_n(&sh->head_time, __ATOMIC_RELAXED) < sl->window) {
+				__atomic_fetch_add(&sh->late, 1, __ATOMIC_RELAXED);
+				return false;
+			}
+
+			/* Peer restarted: a full wrap ahead of the head is newer than every slot and
+			   the slot stays the same, copies racing here compute the same number */
+			ext += 1 << 16;
+		}
+	} while(!__atomic_compare_exchange_n(slot, &v, ext + 1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+	/* Move the shard's head forward */
+	uint64_t head = __atomic_load_n(&sh->head, __ATOMIC_RELAXED);
+	while(head < ext + 1 && !__atomic_compare_exchange_n(&sh->head, &head, ext + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	__atomic_store_n(&sh->head_time, now, __ATOMIC_RELAXED);
+
+	return true;
+}
+
+/* Datagrams dropped as too late */
+unsigned long shard_lookup_late(shard_lookup_t *sl) {
+	unsigned long late = 0;
+	uint64_t i;
+	for(i = 0; i <= sl->shard_mask; i++) late += __atomic_load_n(&sl->shards[i].late, __ATOMIC_RELAXED);
+	return late;
+}
+
+void free_shard_lookup(shard_lookup_t *sl) {
+	free(sl->slots);
+	free(sl->shards);
+	free(sl);
+}
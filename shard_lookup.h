@@ -0,0 +1,18 @@
+#ifndef SHARD_LOOKUP_H
+#define SHARD_LOOKUP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct _shard_lookup_t shard_lookup_t;
+
+shard_lookup_t *new_shard_lookup(int size, int shards);
+void shard_lookup_set_window(shard_lookup_t *sl, uint64_t window);
+bool shard_lookup_push(shard_lookup_t *sl, int seq, uint64_t now);
+bool shard_lookup_seen(shard_lookup_t *sl, int seq);
+int shard_lookup_shard(shard_lookup_t *sl, int seq);
+int shard_lookup_shards(shard_lookup_t *sl);
+unsigned long shard_lookup_late(shard_lookup_t *sl);
+void free_shard_lookup(shard_lookup_t *sl);
+
+#endif
@@ -0,0 +1,263 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Eugene Zagidullin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/*
+Stress test and throughput benchmark of the sharded duplicate filter.
+
+Every receiver thread gets copies of the same stream of sequence numbers,
+each copy of a datagram arriving later than the previous one by the given
+skew, like copies coming over paths of different delay. Without steering
+every thread sees the whole stream and races with the others for every
+sequence number; with steering (-s) a thread only gets the sequence numbers
+of its own shard, as SO_REUSEPORT steering by sequence number would do.
+
+Exactly one copy of every datagram must win, the exit status is non-zero
+if any is accepted twice or missed without being counted as late.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "shard_lookup.h"
+#include "seen_lookup.h"
+
+#define MAX_THREADS 64
+
+typedef struct _bench_t bench_t;
+
+typedef struct {
+    bench_t *bench;
+    int id;
+    uint64_t pushes;
+    uint8_t *won;
+    pthread_t thread;
+
+    /* Steps done, read by other threads */
+    uint64_t progress __attribute__((aligned(64)));
+} receiver_t;
+
+struct _bench_t {
+    int threads;
+    uint64_t count;
+    int copies;
+    int skew;
+    bool steer;
+
+    /* How far a thread may run ahead of the slowest one, in steps */
+    uint64_t lag;
+
+    shard_lookup_t *sl;
+
+    /* Single threaded filter behind a mutex for comparison */
+    lookup_t *lu;
+    pthread_mutex_t mutex;
+
+    receiver_t receivers[MAX_THREADS];
+};
+
+static void wait_slowest(bench_t *b, uint64_t step) {
+    for(;;) {
+        uint64_t slowest = UINT64_MAX;
+        int i;
+        for(i = 0; i < b->threads; i++) {
+            uint64_t p = __atomic_load_n(&b->receivers[i].progress, __ATOMIC_ACQUIRE);
+            if(p < slowest) slowest = p;
+        }
+        if(step < slowest + b->lag) return;
+        sched_yield();
+    }
+}
+
+static bool push(bench_t *b, int seq) {
+    if(!b->lu) return shard_lookup_push(b->sl, seq, 0);
+
+    pthread_mutex_lock(&b->mutex);
+    bool ret = lookup_push(b->lu, seq, 0);
+    pthread_mutex_unlock(&b->mutex);
+    return ret;
+}
+
+static void *receiver_thread(void *arg) {
+    receiver_t *r = arg;
+    bench_t *b = r->bench;
+    uint64_t steps = b->count + (uint64_t)(b->copies - 1) * b->skew, step;
+    int c;
+
+    for(step = 0; step < steps; step++) {
+        if(!(step & 63)) {
+            __atomic_store_n(&r->progress, step, __ATOMIC_RELEASE);
+            wait_slowest(b, step);
+        }
+
+        /* Copy c of datagram i arrives at step i + c * skew */
+        for(c = 0; c < b->copies; c++) {
+            uint64_t i = step - (uint64_t)c * b->skew;
+            if(step < (uint64_t)c * b->skew || i >= b->count) continue;
+
+            int seq = (uint16_t)i;
+            if(b->steer && shard_lookup_shard(b->sl, seq) % b->threads != r->id) continue;
+
+            r->pushes++;
+            if(push(b, seq) && r->won[i] < 255) r->won[i]++;
+        }
+    }
+    __atomic_store_n(&r->progress, UINT64_MAX, __ATOMIC_RELEASE);
+
+    return NULL;
+}
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *argv0) {
+    printf("Usage: %s [-t threads] [-n datagrams] [-c copies] [-k skew] [-w window] [-S shards] [-s] [-l]\n"
+        "  -t  receiver threads, default 4\n"
+        "  -n  datagrams, default 10000000\n"
+        "  -c  copies of every datagram each thread gets, default 1\n"
+        "  -k  datagrams between successive copies, default 100\n"
+        "  -w  sequence numbers to keep, default 1024\n"
+        "  -S  shards, default number of threads\n"
+        "  -s  steer datagrams to the thread owning their shard\n"
+        "  -l  use single threaded filter behind a mutex instead\n", argv0);
+}
+
+int main(int argc, char **argv) {
+    static bench_t b = {.threads = 4, .count = 10000000, .copies = 1, .skew = 100};
+    int window = 1024, shards = 0, i, t;
+    bool locked = false;
+
+    int ch;
+    while((ch = getopt(argc, argv, "t:n:c:k:w:S:slh")) != -1) {
+        switch(ch) {
+            case 't':
+                b.threads = strtol(optarg, NULL, 0);
+                break;
+
+            case 'n':
+                b.count = strtoull(optarg, NULL, 0);
+                break;
+
+            case 'c':
+                b.copies = strtol(optarg, NULL, 0);
+                break;
+
+            case 'k':
+                b.skew = strtol(optarg, NULL, 0);
+                break;
+
+            case 'w':
+                window = strtol(optarg, NULL, 0);
+                break;
+
+            case 'S':
+                shards = strtol(optarg, NULL, 0);
+                break;
+
+            case 's':
+                b.steer = true;
+                break;
+
+            case 'l':
+                locked = true;
+                break;
+
+            default:
+                usage(argv[0]);
+                exit(ch == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+
+    if(b.threads < 1 || b.threads > MAX_THREADS || b.copies < 1 || b.skew < 0 || window < 1 || shards < 0 || (locked && b.steer)) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    /* Threads drifting apart by more than the window would make copies late */
+    b.lag = window / 2 > 64 ? window / 2 : 64;
+
+    b.sl = new_shard_lookup(window, shards ? shards : b.threads);
+    if(!b.sl) {
+        perror("new_shard_lookup");
+        exit(EXIT_FAILURE);
+    }
+    if(locked) {
+        b.lu = new_lookup(window);
+        pthread_mutex_init(&b.mutex, NULL);
+    }
+
+    double start = now_sec();
+    for(i = 0; i < b.threads; i++) {
+        receiver_t *r = &b.receivers[i];
+        r->bench = &b;
+        r->id = i;
+        r->won = calloc(b.count, 1);
+        if(!r->won) {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+        pthread_create(&r->thread, NULL, receiver_thread, r);
+    }
+
+    uint64_t pushes = 0;
+    for(i = 0; i < b.threads; i++) {
+        pthread_join(b.receivers[i].thread, NULL);
+        pushes += b.receivers[i].pushes;
+    }
+    double elapsed = now_sec() - start;
+
+    uint64_t missed = 0, twice = 0, j;
+    for(j = 0; j < b.count; j++) {
+        unsigned int won = 0;
+        for(t = 0; t < b.threads; t++) won += b.receivers[t].won[j];
+        if(!won) missed++;
+        if(won > 1) twice++;
+    }
+    unsigned long late = locked ? lookup_late(b.lu) : shard_lookup_late(b.sl);
+
+    printf("%d threads, %s filter with %d shards, %s\n", b.threads, locked ? "locked" : "sharded",
+        locked ? 1 : shard_lookup_shards(b.sl), b.steer ? "steered" : "not steered");
+    printf("%.3f s, %.2f M lookups/s\n", elapsed, pushes / elapsed / 1e6);
+    printf("%lu datagrams, %lu lookups, %lu missed, %lu accepted more than once, %lu dropped as late\n",
+        (unsigned long)b.count, (unsigned long)pushes, (unsigned long)missed, (unsigned long)twice, late);
+
+    /* Missed datagrams are fine only if all copies of them were too late */
+    bool ok = !twice && (!missed || late);
+    printf("%s\n", ok ? "OK" : "FAIL");
+
+    for(i = 0; i < b.threads; i++) free(b.receivers[i].won);
+    if(locked) free_lookup(b.lu);
+    free_shard_lookup(b.sl);
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
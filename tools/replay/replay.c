@@ -0,0 +1,783 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Eugene Zagidullin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/*
+Replays recorded inbound traffic through a local udprelayd pair.
+
+Datagrams from a pcap or pcapng file are sent to the listening node with their
+recorded timing. Every relay path goes through an emulator in this process which
+applies delay, jitter and loss from a per-path trace, both ways. Datagrams coming
+out of the forwarding node are matched by index to report loss and latency.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define MAX_PATHS 16
+#define MAX_OPTS 32
+#define BUF_SZ 65536
+#define DRAIN_USEC 2000000
+#define STARTUP_USEC 500000
+
+#define LINKTYPE_EN10MB 1
+#define LINKTYPE_RAW 101
+#define LINKTYPE_LINUX_SLL 113
+#define LINKTYPE_USER1 148
+#define LINKTYPE_IPV4 228
+#define LINKTYPE_IPV6 229
+
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+
+/* Recorded inbound datagram */
+typedef struct {
+    uint64_t offset; /* usec from the first one */
+    uint8_t *data;
+    size_t length;
+} packet_t;
+
+/* Path conditions from offset on */
+typedef struct {
+    uint64_t offset;
+    uint32_t delay;
+    uint32_t jitter;
+    double loss;
+} point_t;
+
+typedef struct {
+    point_t *points;
+    int points_num;
+    int cur;
+
+    /* Socket facing listening node and socket facing forwarding node */
+    int fd[2];
+    struct sockaddr_in peer[2];
+
+    unsigned long passed[2];
+    unsigned long dropped[2];
+} path_t;
+
+/* Datagram held by path emulator */
+typedef struct {
+    uint64_t time;
+    path_t *path;
+    int dir;
+    size_t length;
+    uint8_t *data;
+} event_t;
+
+typedef struct {
+    event_t *items;
+    int len;
+    int size;
+} heap_t;
+
+static uint64_t time_usec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* xorshift64*, reproducible with the same seed */
+static uint64_t rnd_state = 1;
+static double rnd(void) {
+    rnd_state ^= rnd_state >> 12;
+    rnd_state ^= rnd_state << 25;
+    rnd_state ^= rnd_state >> 27;
+    return (double)((rnd_state * 2685821657736338717ULL) >> 11) / (double)(1ULL << 53);
+}
+
+static void heap_push(heap_t *heap, const event_t *ev) {
+    if(heap->len == heap->size) {
+        heap->size = heap->size ? heap->size * 2 : 256;
+        heap->items = realloc(heap->items, heap->size * sizeof(event_t));
+    }
+
+    int i = heap->len++;
+    while(i > 0) {
+        int parent = (i - 1) / 2;
+        if(heap->items[parent].time <= ev->time) break;
+        heap->items[i] = heap->items[parent];
+        i = parent;
+    }
+    heap->items[i] = *ev;
+}
+
+static void heap_pop(heap_t *heap, event_t *ev) {
+    *ev = heap->items[0];
+    event_t last = heap->items[--heap->len];
+
+    int i = 0;
+    while(1) {
+        int child = i * 2 + 1;
+        if(child >= heap->len) break;
+        if(child + 1 < heap->len && heap->items[child + 1].time < heap->items[child].time) child++;
+        if(last.time <= heap->items[child].time) break;
+        heap->items[i] = heap->items[child];
+        i = child;
+    }
+    if(heap->len) heap->items[i] = last;
+}
+
+/* ----------------------------------------------------------------------------- */
+
+typedef struct {
+    packet_t *items;
+    size_t len;
+    size_t size;
+    uint64_t first;
+    bool started;
+} capture_t;
+
+static uint16_t get16(const uint8_t *p, bool swap) {
+    uint16_t v;
+    memcpy(&v, p, 2);
+    return swap ? __builtin_bswap16(v) : v;
+}
+
+static uint32_t get32(const uint8_t *p, bool swap) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return swap ? __builtin_bswap32(v) : v;
+}
+
+/* Find UDP payload, returns offset or -1 */
+static long udp_payload(const uint8_t *p, size_t len, size_t *payload_len) {
+    size_t off = 0, hlen;
+    int proto;
+
+    if(len < 1) return -1;
+    if((p[0] >> 4) == 4) {
+        if(len < 20) return -1;
+        hlen = (p[0] & 0x0f) * 4;
+        proto = p[9];
+        /* Only first fragments carry UDP header */
+        if((((p[6] & 0x1f) << 8) | p[7]) != 0) return -1;
+    } else if((p[0] >> 4) == 6) {
+        if(len < 40) return -1;
+        hlen = 40;
+        proto = p[6];
+    } else {
+        return -1;
+    }
+
+    if(proto != IPPROTO_UDP || len < hlen + 8) return -1;
+    off = hlen;
+
+    size_t udp_len = ((size_t)p[off + 4] << 8) | p[off + 5];
+    if(udp_len < 8) return -1;
+
+    *payload_len = udp_len - 8;
+    return off + 8;
+}
+
+/* Add captured frame, length is original length of frame */
+static void capture_add(capture_t *cap, int linktype, uint64_t ts, const uint8_t *frame, size_t caplen, size_t length) {
+    long off = 0;
+    size_t payload_len = length;
+
+    switch(linktype) {
+        case LINKTYPE_USER1:
+            break;
+
+        case LINKTYPE_EN10MB:
+            if(caplen < 14) return;
+            off = 14;
+            /* 802.1Q */
+            if(get16(frame + 12, false) == htons(0x8100)) off += 4;
+            break;
+
+        case LINKTYPE_LINUX_SLL:
+            off = 16;
+            break;
+
+        case LINKTYPE_RAW:
+        case LINKTYPE_IPV4:
+        case LINKTYPE_IPV6:
+            break;
+
+        default:
+            return;
+    }
+
+    if(linktype != LINKTYPE_USER1) {
+        if((size_t)off >= caplen) return;
+        long udp = udp_payload(frame + off, caplen - off, &payload_len);
+        if(udp < 0) return;
+        off += udp;
+    }
+
+    if(!cap->started) {
+        cap->first = ts;
+        cap->started = true;
+    }
+
+    if(cap->len == cap->size) {
+        cap->size = cap->size ? cap->size * 2 : 1024;
+        cap->items = realloc(cap->items, cap->size * sizeof(packet_t));
+    }
+
+    /* Truncated datagrams are padded to original size, first 4 bytes carry index */
+    packet_t *pkt = &cap->items[cap->len++];
+    pkt->offset = ts > cap->first ? ts - cap->first : 0;
+    pkt->length = MAX(MIN(payload_len, BUF_SZ), 4);
+    pkt->data = calloc(1, pkt->length);
+    if((size_t)off < caplen) memcpy(pkt->data, frame + off, MIN(caplen - off, pkt->length));
+}
+
+static uint64_t ts_usec(uint64_t ts, uint8_t tsresol) {
+    if(tsresol & 0x80) {
+        int shift = tsresol & 0x7f;
+        return shift >= 20 ? (ts >> (shift - 20)) * 1000000 >> 20 : ts * 1000000 >> shift;
+    }
+
+    uint64_t div = 1, mul = 1;
+    int i;
+    for(i = 6; i < tsresol; i++) div *= 10;
+    for(i = tsresol; i < 6; i++) mul *= 10;
+    return ts / div * mul;
+}
+
+static int read_pcap(capture_t *cap, const uint8_t *buf, size_t len) {
+    uint32_t magic = get32(buf, false);
+    bool swap = magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1;
+    bool nsec = magic == 0xa1b23c4d || magic == 0x4d3cb2a1;
+
+    if(len < 24) return -1;
+    int linktype = get32(buf + 20, swap) & 0xffff;
+
+    size_t off = 24;
+    while(off + 16 <= len) {
+        uint64_t sec = get32(buf + off, swap);
+        uint64_t frac = get32(buf + off + 4, swap);
+        uint32_t caplen = get32(buf + off + 8, swap);
+        uint32_t length = get32(buf + off + 12, swap);
+        off += 16;
+        if(off + caplen > len) break;
+
+        capture_add(cap, linktype, sec * 1000000 + (nsec ? frac / 1000 : frac), buf + off, caplen, length);
+        off += caplen;
+    }
+    return 0;
+}
+
+#define PCAPNG_SHB 0x0A0D0D0A
+#define PCAPNG_IDB 1
+#define PCAPNG_SPB 3
+#define PCAPNG_EPB 6
+
+typedef struct {
+    int linktype;
+    uint8_t tsresol;
+} iface_t;
+
+/* Only inbound packets are taken when direction is recorded */
+static int read_pcapng(capture_t *cap, const uint8_t *buf, size_t len) {
+    iface_t ifaces[256];
+    int ifaces_num = 0;
+    bool swap = false;
+
+    size_t off = 0;
+    while(off + 12 <= len) {
+        uint32_t type = get32(buf + off, false);
+        if(type == PCAPNG_SHB) {
+            if(off + 12 > len) break;
+            swap = get32(buf + off + 8, false) != 0x1A2B3C4D;
+            ifaces_num = 0;
+        }
+
+        uint32_t blen = get32(buf + off + 4, swap);
+        if(blen < 12 || off + blen > len) break;
+        const uint8_t *body = buf + off + 8;
+        size_t body_len = blen - 12;
+
+        if(type == PCAPNG_IDB && body_len >= 8 && ifaces_num < 256) {
+            iface_t *iface = &ifaces[ifaces_num++];
+            iface->linktype = get16(body, swap);
+            iface->tsresol = 6;
+
+            size_t o = 8;
+            while(o + 4 <= body_len) {
+                uint16_t code = get16(body + o, swap), olen = get16(body + o + 2, swap);
+                if(!code) break;
+                if(code == 9 && olen >= 1) iface->tsresol = body[o + 4];
+                o += 4 + ((olen + 3) & ~3);
+            }
+
+        } else if(type == PCAPNG_EPB && body_len >= 20) {
+            uint32_t id = get32(body, swap);
+            uint64_t ts = ((uint64_t)get32(body + 4, swap) << 32) | get32(body + 8, swap);
+            uint32_t caplen = get32(body + 12, swap);
+            uint32_t length = get32(body + 16, swap);
+            if(id >= (uint32_t)ifaces_num || 20 + caplen > body_len) {
+                off += blen;
+                continue;
+            }
+
+            /* epb_flags, lowest 2 bits are direction, 2 = outbound */
+            bool outbound = false;
+            size_t o = 20 + ((caplen + 3) & ~3);
+            while(o + 4 <= body_len) {
+                uint16_t code = get16(body + o, swap), olen = get16(body + o + 2, swap);
+                if(!code) break;
+                if(code == 2 && olen == 4) outbound = (get32(body + o + 4, swap) & 3) == 2;
+                o += 4 + ((olen + 3) & ~3);
+            }
+
+            if(!outbound) {
+                capture_add(cap, ifaces[id].linktype, ts_usec(ts, ifaces[id].tsresol), body + 20, caplen, length);
+            }
+
+        } else if(type == PCAPNG_SPB && body_len >= 4 && ifaces_num) {
+            uint32_t length = get32(body, swap);
+            capture_add(cap, ifaces[0].linktype, cap->started ? cap->first : 0, body + 4, MIN(length, body_len - 4), length);
+        }
+
+        off += blen;
+    }
+    return 0;
+}
+
+static int read_capture(capture_t *cap, const char *file) {
+    FILE *fp = fopen(file, "r");
+    if(!fp) {
+        perror(file);
+        return -1;
+    }
+
+    size_t size = 0, len = 0;
+    uint8_t *buf = NULL;
+    while(1) {
+        if(len == size) {
+            size = size ? size * 2 : 1 << 20;
+            buf = realloc(buf, size);
+        }
+        size_t n = fread(buf + len, 1, size - len, fp);
+        if(!n) break;
+        len += n;
+    }
+    fclose(fp);
+
+    int ret = -1;
+    if(len >= 4) {
+        uint32_t magic = get32(buf, false);
+        if(magic == PCAPNG_SHB) {
+            ret = read_pcapng(cap, buf, len);
+        } else if(magic == 0xa1b2c3d4 || magic == 0xd4c3b2a1 || magic == 0xa1b23c4d || magic == 0x4d3cb2a1) {
+            ret = read_pcap(cap, buf, len);
+        }
+    }
+    if(ret < 0) fprintf(stderr, "%s: unknown file format\n", file);
+
+    free(buf);
+    return ret;
+}
+
+/* ----------------------------------------------------------------------------- */
+
+/* Lines of "offset_ms delay_ms jitter_ms loss_percent" */
+static int read_trace(path_t *path, const char *file) {
+    FILE *fp = fopen(file, "r");
+    if(!fp) {
+        perror(file);
+        return -1;
+    }
+
+    char buf[256];
+    int line = 0;
+    while(fgets(buf, sizeof(buf), fp)) {
+        line++;
+        char *eol = strchr(buf, '#');
+        if(eol) *eol = '\0';
+
+        double offset, delay, jitter = 0, loss = 0;
+        int n = sscanf(buf, "%lf %lf %lf %lf", &offset, &delay, &jitter, &loss);
+        if(n <= 0) continue;
+        if(n < 2) {
+            fprintf(stderr, "%s:%d: expected offset and delay\n", file, line);
+            fclose(fp);
+            return -1;
+        }
+
+        path->points = realloc(path->points, (path->points_num + 1) * sizeof(point_t));
+        point_t *pt = &path->points[path->points_num++];
+        pt->offset = offset * 1000;
+        pt->delay = delay * 1000;
+        pt->jitter = jitter * 1000;
+        pt->loss = loss / 100;
+    }
+    fclose(fp);
+
+    if(!path->points_num) {
+        fprintf(stderr, "%s: empty trace\n", file);
+        return -1;
+    }
+    return 0;
+}
+
+static const point_t *path_point(path_t *path, uint64_t offset) {
+    /* Time never goes back */
+    while(path->cur + 1 < path->points_num && path->points[path->cur + 1].offset <= offset) path->cur++;
+    return &path->points[path->cur];
+}
+
+static int udp_socket(int port) {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if(fd < 0) return -1;
+
+    int sz = 4 << 20;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &sz, sizeof(sz));
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sz, sizeof(sz));
+
+    struct sockaddr_in sa = {.sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    if(bind(fd, (struct sockaddr*)&sa, sizeof(sa)) < 0) {
+        fprintf(stderr, "bind 127.0.0.1:%d: %s\n", port, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    return fd;
+}
+
+static struct sockaddr_in loopback(int port) {
+    struct sockaddr_in sa = {.sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    return sa;
+}
+
+static pid_t spawn(const char *bin, const char *conf, bool verbose) {
+    pid_t pid = fork();
+    if(pid) return pid;
+
+    if(!verbose) {
+        int fd = open("/dev/null", O_WRONLY);
+        dup2(fd, STDERR_FILENO);
+    }
+    execl(bin, bin, conf, (char*)NULL);
+    fprintf(stderr, "%s: %s\n", bin, strerror(errno));
+    _exit(EXIT_FAILURE);
+}
+
+/* Relays of a node use ports base + i * 4 + local and base + i * 4 + remote */
+static int write_conf(const char *file, const char *outward, int port, int paths_num, int base, int local, int remote,
+    char **opts, int opts_num) {
+
+    FILE *fp = fopen(file, "w");
+    if(!fp) {
+        perror(file);
+        return -1;
+    }
+
+    int i;
+    fprintf(fp, "%s 127.0.0.1:%d\n", outward, port);
+    for(i = 0; i < paths_num; i++) {
+        fprintf(fp, "relay local 127.0.0.1:%d remote 127.0.0.1:%d\n", base + i * 4 + local, base + i * 4 + remote);
+    }
+    for(i = 0; i < opts_num; i++) fprintf(fp, "%s\n", opts[i]);
+
+    fclose(fp);
+    return 0;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static void usage(const char *argv0) {
+    printf("Usage: %s [-b udprelayd] [-p port] [-s speed] [-r seed] [-o option]... [-v] -t trace... capture\n"
+        "  -b  udprelayd binary, default ./udprelayd\n"
+        "  -p  first of local ports to use, default 40000\n"
+        "  -s  replay speed factor, default 1\n"
+        "  -r  random seed for loss and jitter, default 1\n"
+        "  -o  config line added to both nodes, e.g. \"mode kofn\"\n"
+        "  -t  path trace, one per relay: lines of \"offset_ms delay_ms [jitter_ms [loss_percent]]\"\n"
+        "  -v  show udprelayd log\n", argv0);
+}
+
+int main(int argc, char **argv) {
+    const char *bin = "./udprelayd";
+    int base = 40000;
+    double speed = 1;
+    bool verbose = false;
+    char *opts[MAX_OPTS];
+    int opts_num = 0;
+    path_t paths[MAX_PATHS];
+    int paths_num = 0;
+    int i, dir;
+
+    memset(paths, 0, sizeof(paths));
+
+    int ch;
+    while((ch = getopt(argc, argv, "b:p:s:r:o:t:vh")) != -1) {
+        switch(ch) {
+            case 'b':
+                bin = optarg;
+                break;
+
+            case 'p':
+                base = strtol(optarg, NULL, 0);
+                break;
+
+            case 's':
+                speed = strtod(optarg, NULL);
+                break;
+
+            case 'r':
+                rnd_state = strtoull(optarg, NULL, 0) | 1;
+                break;
+
+            case 'o':
+                if(opts_num < MAX_OPTS) opts[opts_num++] = optarg;
+                break;
+
+            case 't':
+                if(paths_num == MAX_PATHS) {
+                    fprintf(stderr, "Too many paths\n");
+                    exit(EXIT_FAILURE);
+                }
+                if(read_trace(&paths[paths_num++], optarg) < 0) exit(EXIT_FAILURE);
+                break;
+
+            case 'v':
+                verbose = true;
+                break;
+
+            default:
+                usage(argv[0]);
+                exit(ch == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+
+    if(optind >= argc || !paths_num || speed <= 0) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    capture_t cap;
+    memset(&cap, 0, sizeof(cap));
+    if(read_capture(&cap, argv[optind]) < 0) exit(EXIT_FAILURE);
+    if(!cap.len) {
+        fprintf(stderr, "No UDP datagrams in %s\n", argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+
+    /* Ports: listen, forward, then per path node A, emulator facing A, emulator facing B, node B */
+    int relay_base = base + 2;
+    for(i = 0; i < paths_num; i++) {
+        int port = relay_base + i * 4;
+        for(dir = 0; dir < 2; dir++) {
+            if((paths[i].fd[dir] = udp_socket(port + 1 + dir)) < 0) exit(EXIT_FAILURE);
+        }
+        paths[i].peer[0] = loopback(port);
+        paths[i].peer[1] = loopback(port + 3);
+    }
+
+    int src = udp_socket(0), sink = udp_socket(base + 1);
+    if(src < 0 || sink < 0) exit(EXIT_FAILURE);
+    struct sockaddr_in listen_sa = loopback(base);
+
+    char tmpdir[] = "/tmp/udprelay-replay.XXXXXX";
+    if(!mkdtemp(tmpdir)) {
+        perror("mkdtemp");
+        exit(EXIT_FAILURE);
+    }
+    char conf_a[64], conf_b[64];
+    snprintf(conf_a, sizeof(conf_a), "%s/a.conf", tmpdir);
+    snprintf(conf_b, sizeof(conf_b), "%s/b.conf", tmpdir);
+
+    if(write_conf(conf_a, "listen", base, paths_num, relay_base, 0, 1, opts, opts_num) < 0 ||
+        write_conf(conf_b, "forward", base + 1, paths_num, relay_base, 3, 2, opts, opts_num) < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    pid_t pid_a = spawn(bin, conf_a, verbose);
+    pid_t pid_b = spawn(bin, conf_b, verbose);
+    usleep(STARTUP_USEC);
+
+    uint64_t *sent = calloc(cap.len, sizeof(uint64_t));
+    uint64_t *latency = calloc(cap.len, sizeof(uint64_t));
+    bool *received = calloc(cap.len, sizeof(bool));
+    unsigned long delivered = 0, duplicates = 0, unknown = 0;
+
+    heap_t heap;
+    memset(&heap, 0, sizeof(heap));
+
+    struct pollfd pfds[MAX_PATHS * 2 + 1];
+    uint8_t *buf = malloc(BUF_SZ);
+
+    uint64_t start = time_usec();
+    uint64_t end = 0;
+    size_t next = 0;
+
+    while(1) {
+        uint64_t now = time_usec();
+
+        /* Feed recorded datagrams */
+        while(next < cap.len && start + (uint64_t)(cap.items[next].offset / speed) <= now) {
+            packet_t *pkt = &cap.items[next];
+            uint32_t idx = htonl(next);
+            memcpy(pkt->data, &idx, 4);
+
+            sent[next] = now;
+            if(sendto(src, pkt->data, pkt->length, 0, (struct sockaddr*)&listen_sa, sizeof(listen_sa)) < 0 && errno != EAGAIN) {
+                perror("sendto");
+            }
+            if(++next == cap.len) end = now + DRAIN_USEC;
+        }
+
+        /* Deliver datagrams whose delay has passed */
+        while(heap.len && heap.items[0].time <= now) {
+            event_t ev;
+            heap_pop(&heap, &ev);
+            path_t *path = ev.path;
+            sendto(path->fd[!ev.dir], ev.data, ev.length, 0, (struct sockaddr*)&path->peer[!ev.dir], sizeof(struct sockaddr_in));
+            free(ev.data);
+        }
+
+        if(end && now >= end && (!heap.len || now >= end + DRAIN_USEC)) break;
+
+        int64_t timeout = -1;
+        if(next < cap.len) timeout = start + (uint64_t)(cap.items[next].offset / speed) - now;
+        if(heap.len) {
+            int64_t t = heap.items[0].time - now;
+            if(timeout < 0 || t < timeout) timeout = t;
+        }
+        if(end) {
+            int64_t t = end - now;
+            if(timeout < 0 || t < timeout) timeout = t;
+        }
+
+        int nfds = 0;
+        for(i = 0; i < paths_num; i++) {
+            for(dir = 0; dir < 2; dir++) {
+                pfds[nfds].fd = paths[i].fd[dir];
+                pfds[nfds++].events = POLLIN;
+            }
+        }
+        pfds[nfds].fd = sink;
+        pfds[nfds++].events = POLLIN;
+
+        /* poll() has msec resolution, spin through the last one */
+        if(poll(pfds, nfds, timeout < 0 ? -1 : timeout / 1000) <= 0) continue;
+        now = time_usec();
+
+        for(i = 0; i < paths_num; i++) {
+            path_t *path = &paths[i];
+
+            for(dir = 0; dir < 2; dir++) {
+                if(!(pfds[i * 2 + dir].revents & POLLIN)) continue;
+
+                ssize_t sz;
+                while((sz = recv(path->fd[dir], buf, BUF_SZ, 0)) >= 0) {
+                    const point_t *pt = path_point(path, (uint64_t)((now - start) * speed));
+
+                    if(pt->loss > 0 && rnd() < pt->loss) {
+                        path->dropped[dir]++;
+                        continue;
+                    }
+                    path->passed[dir]++;
+
+                    /* Jitter reorders datagrams */
+                    event_t ev = {
+                        .time = now + (uint64_t)((pt->delay + rnd() * pt->jitter) / speed),
+                        .path = path,
+                        .dir = dir,
+                        .length = sz,
+                        .data = memcpy(malloc(sz ? sz : 1), buf, sz),
+                    };
+                    heap_push(&heap, &ev);
+                }
+            }
+        }
+
+        if(pfds[nfds - 1].revents & POLLIN) {
+            ssize_t sz;
+            while((sz = recv(sink, buf, BUF_SZ, 0)) >= 0) {
+                uint32_t idx;
+                if(sz < 4) {
+                    unknown++;
+                    continue;
+                }
+                memcpy(&idx, buf, 4);
+                idx = ntohl(idx);
+
+                if(idx >= next) {
+                    unknown++;
+                } else if(received[idx]) {
+                    duplicates++;
+                } else {
+                    received[idx] = true;
+                    latency[delivered++] = now - sent[idx];
+                }
+            }
+        }
+    }
+
+    kill(pid_a, SIGTERM);
+    kill(pid_b, SIGTERM);
+    waitpid(pid_a, NULL, 0);
+    waitpid(pid_b, NULL, 0);
+    unlink(conf_a);
+    unlink(conf_b);
+    rmdir(tmpdir);
+
+    /* Report */
+    printf("datagrams: sent %zu, delivered %lu, lost %lu (%.2f%%), duplicates %lu, unknown %lu\n",
+        cap.len, delivered, (unsigned long)(cap.len - delivered), 100.0 * (cap.len - delivered) / cap.len, duplicates, unknown);
+
+    if(delivered) {
+        qsort(latency, delivered, sizeof(uint64_t), cmp_u64);
+        uint64_t sum = 0;
+        unsigned long j;
+        for(j = 0; j < delivered; j++) sum += latency[j];
+
+        printf("latency, ms: min %.3f, avg %.3f, p50 %.3f, p90 %.3f, p99 %.3f, max %.3f\n",
+            latency[0] / 1000.0, sum / 1000.0 / delivered,
+            latency[delivered / 2] / 1000.0, latency[delivered * 9 / 10] / 1000.0,
+            latency[delivered * 99 / 100] / 1000.0, latency[delivered - 1] / 1000.0);
+    }
+
+    for(i = 0; i < paths_num; i++) {
+        printf("path %d: forward %lu passed, %lu dropped; backward %lu passed, %lu dropped\n", i,
+            paths[i].passed[0], paths[i].dropped[0], paths[i].passed[1], paths[i].dropped[1]);
+    }
+
+    return 0;
+}
@@ -0,0 +1,242 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Eugene Zagidullin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/*
+Stress test and throughput benchmark of MPSC ring.
+
+Producer threads push numbered messages in batches, consumer checks that
+every producer's messages arrive exactly once, in order and intact, and
+sleeps on eventfd whenever the ring is empty. Exits with non-zero status
+if anything is lost, duplicated, reordered or corrupted.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "mpsc.h"
+
+#define MAX_PRODUCERS 64
+
+typedef struct {
+    uint32_t producer;
+    uint32_t _pad;
+    uint64_t counter;
+} msg_t;
+
+typedef struct {
+    mpsc_t *q;
+    int id;
+    uint64_t count;
+    size_t batch;
+    size_t size;
+    uint64_t full;
+    pthread_t thread;
+} producer_t;
+
+typedef struct {
+    uint64_t next[MAX_PRODUCERS];
+    uint64_t received;
+    uint64_t errors;
+    size_t size;
+} consumer_t;
+
+static uint8_t pattern(const msg_t *m, size_t i) {
+    return (uint8_t)(m->counter * 31 + m->producer * 7 + i);
+}
+
+static void *producer_thread(void *arg) {
+    producer_t *p = arg;
+    uint64_t counter = 0;
+
+    while(counter < p->count) {
+        size_t want = p->batch;
+        if(want > p->count - counter) want = p->count - counter;
+
+        uint64_t pos;
+        size_t n = mpsc_claim(p->q, want, &pos), i, j;
+        if(!n) {
+            p->full++;
+            sched_yield();
+            continue;
+        }
+
+        for(i = 0; i < n; i++) {
+            uint8_t *data = mpsc_slot(p->q, pos + i);
+            msg_t m = {.producer = p->id, .counter = counter++};
+            memcpy(data, &m, sizeof(m));
+            for(j = sizeof(m); j < p->size; j++) data[j] = pattern(&m, j);
+            mpsc_commit(p->q, pos + i, p->size);
+        }
+        mpsc_notify(p->q);
+    }
+
+    return NULL;
+}
+
+static void check(void *ctx, const void *data, size_t length) {
+    consumer_t *c = ctx;
+    msg_t m;
+    size_t j;
+    memcpy(&m, data, sizeof(m));
+
+    if(length != c->size || m.producer >= MAX_PRODUCERS || m.counter != c->next[m.producer]) {
+        if(c->errors++ < 10) {
+            fprintf(stderr, "Producer %u: expected %lu, got %lu (length %lu)\n", m.producer,
+                (unsigned long)c->next[m.producer < MAX_PRODUCERS ? m.producer : 0], (unsigned long)m.counter, (unsigned long)length);
+        }
+    } else {
+        for(j = sizeof(m); j < length; j++) {
+            if(((const uint8_t*)data)[j] != pattern(&m, j)) {
+                if(c->errors++ < 10) fprintf(stderr, "Producer %u: message %lu corrupted\n", m.producer, (unsigned long)m.counter);
+                break;
+            }
+        }
+    }
+
+    if(m.producer < MAX_PRODUCERS) c->next[m.producer] = m.counter + 1;
+    c->received++;
+}
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *argv0) {
+    printf("Usage: %s [-p producers] [-n messages] [-b batch] [-s size] [-r slots]\n"
+        "  -p  producer threads, default 4\n"
+        "  -n  messages per producer, default 10000000\n"
+        "  -b  slots claimed at once, default 16\n"
+        "  -s  message size, default 64\n"
+        "  -r  ring slots, default 4096\n", argv0);
+}
+
+int main(int argc, char **argv) {
+    int producers = 4, i;
+    uint64_t count = 10000000;
+    size_t batch = 16, size = 64, slots = 4096;
+
+    int ch;
+    while((ch = getopt(argc, argv, "p:n:b:s:r:h")) != -1) {
+        switch(ch) {
+            case 'p':
+                producers = strtol(optarg, NULL, 0);
+                break;
+
+            case 'n':
+                count = strtoull(optarg, NULL, 0);
+                break;
+
+            case 'b':
+                batch = strtoul(optarg, NULL, 0);
+                break;
+
+            case 's':
+                size = strtoul(optarg, NULL, 0);
+                break;
+
+            case 'r':
+                slots = strtoul(optarg, NULL, 0);
+                break;
+
+            default:
+                usage(argv[0]);
+                exit(ch == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+
+    if(producers < 1 || producers > MAX_PRODUCERS || !batch || size < sizeof(msg_t) || !slots) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    mpsc_t *q = new_mpsc(slots, size);
+    if(!q) {
+        perror("new_mpsc");
+        exit(EXIT_FAILURE);
+    }
+
+    consumer_t c;
+    memset(&c, 0, sizeof(c));
+    c.size = size;
+
+    producer_t p[MAX_PRODUCERS];
+    double start = now_sec();
+    for(i = 0; i < producers; i++) {
+        p[i] = (producer_t){.q = q, .id = i, .count = count, .batch = batch, .size = size};
+        pthread_create(&p[i].thread, NULL, producer_thread, &p[i]);
+    }
+
+    uint64_t total = count * producers, sleeps = 0, wakeups = 0, batches = 0;
+    while(c.received < total) {
+        size_t n = mpsc_consume(q, check, &c, batch * 4);
+        if(n) {
+            batches++;
+            continue;
+        }
+
+        /* Ring is empty, sleep until a producer commits */
+        if(!mpsc_arm(q)) continue;
+        sleeps++;
+
+        struct pollfd pfd = {.fd = mpsc_fd(q), .events = POLLIN};
+        if(poll(&pfd, 1, 1000) == 0) {
+            fprintf(stderr, "Lost wakeup: %lu of %lu messages received\n", (unsigned long)c.received, (unsigned long)total);
+            c.errors++;
+            break;
+        }
+        mpsc_ack(q);
+        wakeups++;
+    }
+    double elapsed = now_sec() - start;
+
+    uint64_t full = 0;
+    for(i = 0; i < producers; i++) {
+        pthread_join(p[i].thread, NULL);
+        full += p[i].full;
+        if(c.next[i] != count) {
+            fprintf(stderr, "Producer %d: %lu of %lu messages received\n", i, (unsigned long)c.next[i], (unsigned long)count);
+            c.errors++;
+        }
+    }
+    free_mpsc(q);
+
+    printf("%d producers, %lu messages of %lu bytes, batch %lu, %lu slots\n", producers, (unsigned long)total,
+        (unsigned long)size, (unsigned long)batch, (unsigned long)slots);
+    printf("%.3f s, %.2f M messages/s, %.2f GB/s\n", elapsed, total / elapsed / 1e6, total * size / elapsed / 1e9);
+    printf("consumer: %lu batches, %lu sleeps, %lu wakeups; producers found ring full %lu times\n",
+        (unsigned long)batches, (unsigned long)sleeps, (unsigned long)wakeups, (unsigned long)full);
+    printf("%s: %lu errors\n", c.errors ? "FAIL" : "OK", (unsigned long)c.errors);
+
+    return c.errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,661 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Eugene Zagidullin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/*
+Deterministic network simulator for udprelayd datapath.
+
+Two udprelay instances run in one process on a virtual clock. Their relays use
+simulated I/O instead of sockets: datagrams go through per-path models of
+bandwidth, queue, delay, jitter, loss and duplication driven by seeded random
+generators, so every run with the same arguments gives the same result.
+Everything above relay I/O (scheduling, duplicate filter, reassembly,
+congestion control) is the real code.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "udprelay.h"
+#include "utils.h"
+
+/* Simulated descriptors don't collide with real ones used by resolver */
+#define SIM_FD_BASE 512
+#define MAX_ENDPOINTS 128
+#define MAX_PATHS 16
+#define MAX_OPTS 32
+#define START_USEC 1000000
+#define DRAIN_USEC 2000000
+
+/* Addresses of outward interfaces and of traffic source and sink */
+#define ADDR_LISTEN "10.255.0.1"
+#define ADDR_SINK "10.255.0.2"
+#define ADDR_SOURCE "10.255.0.3"
+
+typedef struct _datagram_t datagram_t;
+struct _datagram_t {
+    datagram_t *next;
+    int src;
+    size_t length;
+    uint8_t data[0];
+};
+
+typedef struct {
+    struct sockaddr_in sa;
+    relay_t *relay;
+
+    /* Datagrams waiting to be read */
+    datagram_t *head;
+    datagram_t *tail;
+} endpoint_t;
+
+/* One direction of a path */
+typedef struct {
+    uint64_t delay;
+    uint64_t jitter;
+    double loss;
+    double dup;
+    uint64_t bandwidth;     /* bytes per second, 0 = unlimited */
+    uint64_t queue;         /* max queuing delay, usec */
+
+    uint64_t rnd;
+    uint64_t busy_until;
+
+    unsigned long sent;
+    unsigned long lost;
+    unsigned long overflow;
+    unsigned long duplicated;
+} link_t;
+
+typedef struct {
+    int a, b;   /* Endpoints of nodes A and B */
+    link_t link[2];
+} path_t;
+
+typedef struct {
+    uint64_t time;
+    uint64_t order;     /* Keeps equal times in FIFO order */
+    int dst;
+    datagram_t *dgram;
+} event_t;
+
+typedef struct {
+    event_t *items;
+    int len;
+    int size;
+    uint64_t order;
+} heap_t;
+
+static uint64_t now = START_USEC;
+static endpoint_t endpoints[MAX_ENDPOINTS];
+static int endpoints_num;
+static int sink_ep;
+static path_t paths[MAX_PATHS];
+static int paths_num;
+static heap_t events;
+
+/* Sink statistics */
+static uint64_t *sent_time;
+static uint64_t *latency;
+static bool *received;
+static unsigned long packets, delivered, duplicates, unknown;
+
+static uint64_t sim_clock(void) {
+    return now;
+}
+
+/* xorshift64* */
+static double rnd(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return (double)((*state * 2685821657736338717ULL) >> 11) / (double)(1ULL << 53);
+}
+
+static void heap_push(heap_t *heap, uint64_t time, int dst, datagram_t *dgram) {
+    if(heap->len == heap->size) {
+        heap->size = heap->size ? heap->size * 2 : 1024;
+        heap->items = realloc(heap->items, heap->size * sizeof(event_t));
+    }
+
+    event_t ev = {.time = time, .order = heap->order++, .dst = dst, .dgram = dgram};
+    int i = heap->len++;
+    while(i > 0) {
+        int parent = (i - 1) / 2;
+        event_t *p = &heap->items[parent];
+        if(p->time < ev.time || (p->time == ev.time && p->order < ev.order)) break;
+        heap->items[i] = *p;
+        i = parent;
+    }
+    heap->items[i] = ev;
+}
+
+static bool event_before(const event_t *a, const event_t *b) {
+    return a->time < b->time || (a->time == b->time && a->order < b->order);
+}
+
+static void heap_pop(heap_t *heap, event_t *ev) {
+    *ev = heap->items[0];
+    event_t last = heap->items[--heap->len];
+
+    int i = 0;
+    while(1) {
+        int child = i * 2 + 1;
+        if(child >= heap->len) break;
+        if(child + 1 < heap->len && event_before(&heap->items[child + 1], &heap->items[child])) child++;
+        if(!event_before(&heap->items[child], &last)) break;
+        heap->items[i] = heap->items[child];
+        i = child;
+    }
+    if(heap->len) heap->items[i] = last;
+}
+
+static int endpoint_add(const char *addr) {
+    endpoint_t *ep = &endpoints[endpoints_num];
+    ep->sa.sin_family = AF_INET;
+    ep->sa.sin_port = htons(1);
+    inet_pton(AF_INET, addr, &ep->sa.sin_addr);
+    return endpoints_num++;
+}
+
+static int endpoint_find(const struct sockaddr_in *sa) {
+    int i;
+    for(i = 0; i < endpoints_num; i++) {
+        if(endpoints[i].sa.sin_addr.s_addr == sa->sin_addr.s_addr) return i;
+    }
+    return -1;
+}
+
+static int endpoint_lookup(const char *addr) {
+    char host[64];
+    snprintf(host, sizeof(host), "%s", addr);
+    char *port = strchr(host, ':');
+    if(port) *port = '\0';
+
+    struct sockaddr_in sa;
+    if(inet_pton(AF_INET, host, &sa.sin_addr) != 1) return -1;
+    return endpoint_find(&sa);
+}
+
+static datagram_t *datagram(int src, const void *data, size_t length) {
+    datagram_t *d = malloc(sizeof(datagram_t) + length);
+    d->next = NULL;
+    d->src = src;
+    d->length = length;
+    memcpy(d->data, data, length);
+    return d;
+}
+
+/* Traffic sink, datagrams start with index */
+static void sink(const datagram_t *d) {
+    uint64_t idx;
+    if(d->length < sizeof(idx)) {
+        unknown++;
+        return;
+    }
+    memcpy(&idx, d->data, sizeof(idx));
+
+    if(idx >= packets || !sent_time[idx]) {
+        unknown++;
+    } else if(received[idx]) {
+        duplicates++;
+    } else {
+        received[idx] = true;
+        latency[delivered++] = now - sent_time[idx];
+    }
+}
+
+static void deliver(int dst, datagram_t *d) {
+    if(dst == sink_ep) {
+        sink(d);
+        free(d);
+        return;
+    }
+
+    endpoint_t *ep = &endpoints[dst];
+    if(!ep->relay) {
+        /* Nobody listens */
+        free(d);
+        return;
+    }
+
+    if(ep->tail) ep->tail->next = d;
+    else ep->head = d;
+    ep->tail = d;
+}
+
+/* Serialize, queue, delay and maybe lose or duplicate datagram */
+static void link_send(link_t *link, int dst, datagram_t *d) {
+    link->sent++;
+
+    uint64_t start = MAX(now, link->busy_until);
+    if(link->queue && start - now > link->queue) {
+        link->overflow++;
+        free(d);
+        return;
+    }
+    if(link->bandwidth) link->busy_until = start + d->length * 1000000 / link->bandwidth;
+    else link->busy_until = start;
+
+    if(link->loss > 0 && rnd(&link->rnd) < link->loss) {
+        link->lost++;
+        free(d);
+        return;
+    }
+
+    uint64_t t = link->busy_until + link->delay + (uint64_t)(rnd(&link->rnd) * link->jitter);
+    if(link->dup > 0 && rnd(&link->rnd) < link->dup) {
+        link->duplicated++;
+        heap_push(&events, t + (uint64_t)(rnd(&link->rnd) * link->jitter), dst, datagram(d->src, d->data, d->length));
+    }
+    heap_push(&events, t, dst, d);
+}
+
+/* ----------------------------------------------------------------------------- */
+
+static int sim_open(relay_t *relay) {
+    int ep = relay->local_addr ? endpoint_lookup(relay->local_addr) : endpoint_add("10.255.1.0");
+    if(ep < 0 || endpoints[ep].relay) {
+        syslog(LOG_ERR, "%s: no such simulated address", relay->local_addr);
+        return -1;
+    }
+
+    if(!relay->local_addr) {
+        /* Unbound socket gets its own address */
+        endpoints[ep].sa.sin_addr.s_addr = htonl(ntohl(endpoints[ep].sa.sin_addr.s_addr) + ep);
+    }
+
+    if(relay->remote_addr) {
+        int remote = endpoint_lookup(relay->remote_addr);
+        if(remote < 0) {
+            syslog(LOG_ERR, "%s: no such simulated address", relay->remote_addr);
+            return -1;
+        }
+        memcpy(&relay->remote_sa, &endpoints[remote].sa, sizeof(struct sockaddr_in));
+        relay->remote_sa_len = sizeof(struct sockaddr_in);
+    } else {
+        relay->dynamic_out_addr = true;
+    }
+
+    endpoints[ep].relay = relay;
+    relay->fd = SIM_FD_BASE + ep;
+    relay->family = AF_INET;
+    return 0;
+}
+
+static void sim_close(relay_t *relay) {
+    endpoint_t *ep = &endpoints[relay->fd - SIM_FD_BASE];
+    ep->relay = NULL;
+
+    datagram_t *d;
+    while((d = ep->head) != NULL) {
+        ep->head = d->next;
+        free(d);
+    }
+    ep->tail = NULL;
+}
+
+static ssize_t sim_sendto(relay_t *relay, const void *buffer, size_t length) {
+    int src = relay->fd - SIM_FD_BASE;
+    int dst = endpoint_find((const struct sockaddr_in*)&relay->remote_sa.sa);
+    if(dst < 0) {
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+
+    datagram_t *d = datagram(src, buffer, length);
+    int i;
+    for(i = 0; i < paths_num; i++) {
+        if(paths[i].a == src && paths[i].b == dst) {
+            link_send(&paths[i].link[0], dst, d);
+            return length;
+        }
+        if(paths[i].b == src && paths[i].a == dst) {
+            link_send(&paths[i].link[1], dst, d);
+            return length;
+        }
+    }
+
+    /* Local traffic */
+    deliver(dst, d);
+    return length;
+}
+
+static ssize_t sim_recvfrom(relay_t *relay, void *buffer, size_t size, sockaddr_t *sa, socklen_t *salen, uint64_t *stamp) {
+    endpoint_t *ep = &endpoints[relay->fd - SIM_FD_BASE];
+    datagram_t *d = ep->head;
+    if(!d) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if(!(ep->head = d->next)) ep->tail = NULL;
+
+    size_t sz = MIN(size, d->length);
+    memcpy(buffer, d->data, sz);
+    memcpy(sa, &endpoints[d->src].sa, sizeof(struct sockaddr_in));
+    *salen = sizeof(struct sockaddr_in);
+    free(d);
+    return sz;
+}
+
+static const relay_io_t sim_io = {
+    .open = sim_open,
+    .close = sim_close,
+    .sendto = sim_sendto,
+    .recvfrom = sim_recvfrom,
+};
+
+/* ----------------------------------------------------------------------------- */
+
+/* Comma separated key=value: delay, jitter, queue (ms), loss, dup (%), bw (bit/s with k, M, G) */
+static int parse_path(path_t *path, const char *spec, uint64_t seed, int idx) {
+    link_t link;
+    int dir, i;
+    memset(&link, 0, sizeof(link));
+    link.queue = 100000;
+
+    char *tmp = xstrdup(spec), *save = NULL;
+    for(char *tok = strtok_r(tmp, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        char *val = strchr(tok, '=');
+        if(!val) {
+            fprintf(stderr, "%s: expected key=value\n", tok);
+            free(tmp);
+            return -1;
+        }
+        *val++ = '\0';
+
+        if(!strcmp(tok, "delay")) link.delay = strtod(val, NULL) * 1000;
+        else if(!strcmp(tok, "jitter")) link.jitter = strtod(val, NULL) * 1000;
+        else if(!strcmp(tok, "queue")) link.queue = strtod(val, NULL) * 1000;
+        else if(!strcmp(tok, "loss")) link.loss = strtod(val, NULL) / 100;
+        else if(!strcmp(tok, "dup")) link.dup = strtod(val, NULL) / 100;
+        else if(!strcmp(tok, "bw")) link.bandwidth = strtosize(val) / 8;
+        else {
+            fprintf(stderr, "Unknown path parameter %s\n", tok);
+            free(tmp);
+            return -1;
+        }
+    }
+    free(tmp);
+
+    for(dir = 0; dir < 2; dir++) {
+        path->link[dir] = link;
+        path->link[dir].rnd = (seed * 2654435761ULL + idx * 2 + dir) | 1;
+        /* Warm up generator */
+        for(i = 0; i < 16; i++) rnd(&path->link[dir].rnd);
+    }
+    return 0;
+}
+
+static char *write_conf(const char *outward, int side, char **opts, int opts_num) {
+    char *file = xstrdup("/tmp/udprelay-sim.XXXXXX");
+    int fd = mkstemp(file);
+    if(fd < 0) {
+        perror("mkstemp");
+        exit(EXIT_FAILURE);
+    }
+
+    FILE *fp = fdopen(fd, "w");
+    int i;
+    fprintf(fp, "%s\n", outward);
+    for(i = 0; i < paths_num; i++) {
+        fprintf(fp, "relay local 10.0.%d.%d:1 remote 10.0.%d.%d:1\n", i, side + 1, i, 2 - side);
+    }
+    for(i = 0; i < opts_num; i++) fprintf(fp, "%s\n", opts[i]);
+    fclose(fp);
+
+    return file;
+}
+
+/* Run node until it has nothing to read or write, returns its timeout */
+static int64_t node_run(udprelay_t *node) {
+    while(1) {
+        fd_set rfds, wfds, ready;
+        FD_ZERO(&rfds);
+        FD_ZERO(&wfds);
+        FD_ZERO(&ready);
+
+        int maxfd = 0;
+        int64_t timeout = udprelay_fd_set(node, &rfds, &wfds, &maxfd, now);
+
+        /* Only simulated descriptors with pending datagrams are readable, sending never blocks */
+        bool any = false;
+        int i;
+        for(i = 0; i < endpoints_num; i++) {
+            int fd = SIM_FD_BASE + i;
+            if(FD_ISSET(fd, &rfds) && endpoints[i].head) {
+                FD_SET(fd, &ready);
+                any = true;
+            }
+            if(FD_ISSET(fd, &wfds)) any = true;
+        }
+
+        udprelay_timer(node, now);
+        if(!any) return timeout;
+
+        if(udprelay_handle(node, &ready, &wfds) < 0) {
+            fprintf(stderr, "Outward interface failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static void usage(const char *argv0) {
+    printf("Usage: %s [-n packets] [-r rate] [-s size] [-S seed] [-o option]... [-v] -p path...\n"
+        "  -n  number of datagrams, default 100000\n"
+        "  -r  datagrams per second, default 10000\n"
+        "  -s  datagram size, default 200\n"
+        "  -S  random seed, default 1\n"
+        "  -o  config line added to both nodes, e.g. \"mode kofn\"\n"
+        "  -p  relay path, comma separated delay=ms,jitter=ms,loss=%%,dup=%%,bw=bit/s,queue=ms\n"
+        "  -v  show udprelayd log\n", argv0);
+}
+
+int main(int argc, char **argv) {
+    uint64_t rate = 10000, seed = 1;
+    size_t size = 200;
+    bool verbose = false;
+    char *opts[MAX_OPTS];
+    int opts_num = 0;
+    char *specs[MAX_PATHS];
+    int i, dir;
+
+    packets = 100000;
+
+    int ch;
+    while((ch = getopt(argc, argv, "n:r:s:S:o:p:vh")) != -1) {
+        switch(ch) {
+            case 'n':
+                packets = strtosize(optarg);
+                break;
+
+            case 'r':
+                rate = strtosize(optarg);
+                break;
+
+            case 's':
+                size = MAX(strtol(optarg, NULL, 0), (long)sizeof(uint64_t));
+                break;
+
+            case 'S':
+                seed = strtoull(optarg, NULL, 0);
+                break;
+
+            case 'o':
+                if(opts_num < MAX_OPTS) opts[opts_num++] = optarg;
+                break;
+
+            case 'p':
+                if(paths_num == MAX_PATHS) {
+                    fprintf(stderr, "Too many paths\n");
+                    exit(EXIT_FAILURE);
+                }
+                specs[paths_num++] = optarg;
+                break;
+
+            case 'v':
+                verbose = true;
+                break;
+
+            default:
+                usage(argv[0]);
+                exit(ch == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+
+    if(!paths_num || !rate || !packets) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    openlog("udprelay-sim", LOG_PERROR, LOG_USER);
+    setlogmask(verbose ? LOG_UPTO(LOG_DEBUG) : LOG_UPTO(LOG_WARNING));
+
+    /* Address plan */
+    endpoint_add(ADDR_LISTEN);
+    sink_ep = endpoint_add(ADDR_SINK);
+    int source = endpoint_add(ADDR_SOURCE);
+    for(i = 0; i < paths_num; i++) {
+        char addr[32];
+        snprintf(addr, sizeof(addr), "10.0.%d.1", i);
+        paths[i].a = endpoint_add(addr);
+        snprintf(addr, sizeof(addr), "10.0.%d.2", i);
+        paths[i].b = endpoint_add(addr);
+        if(parse_path(&paths[i], specs[i], seed, i) < 0) exit(EXIT_FAILURE);
+    }
+
+    char *conf_a = write_conf("listen " ADDR_LISTEN ":1", 0, opts, opts_num);
+    char *conf_b = write_conf("forward " ADDR_SINK ":1", 1, opts, opts_num);
+
+    set_time_source(sim_clock);
+    relay_set_io(&sim_io);
+
+    udprelay_t node_a, node_b;
+    int ret_a = udprelay_init(&node_a, conf_a), ret_b = ret_a < 0 ? -1 : udprelay_init(&node_b, conf_b);
+    unlink(conf_a);
+    unlink(conf_b);
+    free(conf_a);
+    free(conf_b);
+    if(ret_a < 0 || ret_b < 0) exit(EXIT_FAILURE);
+
+    sent_time = calloc(packets, sizeof(uint64_t));
+    latency = calloc(packets, sizeof(uint64_t));
+    received = calloc(packets, sizeof(bool));
+    uint8_t *payload = calloc(1, size);
+
+    uint64_t interval = MAX(1000000 / rate, 1);
+    uint64_t start = now, end = start + packets * interval + DRAIN_USEC;
+    unsigned long next = 0;
+    unsigned long steps = 0;
+
+    struct timespec wall_start, wall_end;
+    clock_gettime(CLOCK_MONOTONIC, &wall_start);
+
+    while(1) {
+        /* Traffic source */
+        while(next < packets && start + next * interval <= now) {
+            uint64_t idx = next;
+            memcpy(payload, &idx, sizeof(idx));
+            sent_time[next++] = now;
+            deliver(0, datagram(source, payload, size));
+        }
+
+        while(events.len && events.items[0].time <= now) {
+            event_t ev;
+            heap_pop(&events, &ev);
+            deliver(ev.dst, ev.dgram);
+        }
+
+        int64_t ta = node_run(&node_a);
+        int64_t tb = node_run(&node_b);
+        steps++;
+
+        /* Advance virtual clock to the next thing to happen */
+        uint64_t t = end;
+        if(next < packets) t = MIN(t, start + next * interval);
+        if(events.len) t = MIN(t, events.items[0].time);
+        if(ta >= 0) t = MIN(t, now + ta);
+        if(tb >= 0) t = MIN(t, now + tb);
+
+        if(now >= end) break;
+        now = MAX(t, now + 1);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &wall_end);
+    double wall = (wall_end.tv_sec - wall_start.tv_sec) + (wall_end.tv_nsec - wall_start.tv_nsec) / 1e9;
+
+    printf("datagrams: sent %lu, delivered %lu, lost %lu (%.2f%%), duplicates %lu, unknown %lu\n",
+        packets, delivered, packets - delivered, 100.0 * (packets - delivered) / packets, duplicates, unknown);
+
+    if(delivered) {
+        qsort(latency, delivered, sizeof(uint64_t), cmp_u64);
+        uint64_t sum = 0;
+        unsigned long j;
+        for(j = 0; j < delivered; j++) sum += latency[j];
+
+        printf("latency, ms: min %.3f, avg %.3f, p50 %.3f, p90 %.3f, p99 %.3f, max %.3f\n",
+            latency[0] / 1000.0, sum / 1000.0 / delivered,
+            latency[delivered / 2] / 1000.0, latency[delivered * 9 / 10] / 1000.0,
+            latency[delivered * 99 / 100] / 1000.0, latency[delivered - 1] / 1000.0);
+    }
+
+    printf("dropped as too late: forward %lu, backward %lu\n", lookup_late(node_b.lookup), lookup_late(node_a.lookup));
+
+    for(i = 0; i < paths_num; i++) {
+        for(dir = 0; dir < 2; dir++) {
+            link_t *l = &paths[i].link[dir];
+            printf("path %d %s: sent %lu, lost %lu, queue overflow %lu, duplicated %lu\n", i, dir ? "backward" : "forward",
+                l->sent, l->lost, l->overflow, l->duplicated);
+        }
+    }
+
+    printf("virtual time %.3f s, wall time %.3f s, %lu steps, %.0f datagrams per wall second\n",
+        (now - start) / 1e6, wall, steps, packets / wall);
+
+    udprelay_cleanup(&node_a);
+    udprelay_cleanup(&node_b);
+
+    while(events.len) {
+        event_t ev;
+        heap_pop(&events, &ev);
+        free(ev.dgram);
+    }
+
+    return 0;
+}
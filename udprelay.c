@@ -0,0 +1,1225 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Eugene Zagidullin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <syslog.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <stddef.h>
+
+#include "debug.h"
+#include "udprelay.h"
+#include "config.h"
+#include "utils.h"
+
+#define MAX_FRAGS 255
+#define BUF_SZ 65536
+
+#define RESOLVER_THREADS 4
+/* Retry interval for host names which were never resolved */
+#define RESOLVE_RETRY_USEC 5000000
+
+/* Standby relays are probed this often, so failover never picks a dead path */
+#define KEEPALIVE_USEC 1000000
+
+typedef struct _header_t header_t;
+typedef struct _feedback_t feedback_t;
+typedef struct _subheader_t subheader_t;
+
+/* Datagram types */
+enum {
+    HDR_DATA = 0,
+    HDR_FEEDBACK,
+    HDR_BUNDLE,
+    HDR_PROBE,
+    HDR_PROBE_ACK,
+};
+
+/* Sender asks for congestion feedback */
+#define HDR_F_CC 0x01
+/* Payload is deflated */
+#define HDR_F_COMPRESSED 0x02
+
+struct _header_t {
+    uint32_t ts; /* Sender's clock, usec */
+    uint16_t seq;
+    uint16_t pseq; /* Per relay sequence number */
+    uint8_t type;
+    uint8_t flags;
+    /* Fragment index and number of fragments, 0 if not fragmented */
+    uint8_t frag;
+    uint8_t frags;
+#ifdef DEBUG
+    uint16_t pkt_num;
+    uint16_t pkts_in_series;
+#endif
+    uint8_t payload[0];
+};
+
+/* Congestion control needs every copy, the rest of data copies may be dropped by kernel */
+static const dedup_header_t dedup_header = {
+    .seq = offsetof(header_t, seq),
+    .type = offsetof(header_t, type),
+    .data = HDR_DATA,
+    .flags = offsetof(header_t, flags),
+    .keep = HDR_F_CC,
+};
+
+/* HDR_BUNDLE payload is a sequence of these, not aligned */
+struct _subheader_t {
+    uint16_t seq;
+    uint16_t length;
+    uint8_t payload[0];
+};
+
+/* Payload of HDR_FEEDBACK, see cc_report_t */
+struct _feedback_t {
+    uint32_t qdelay;
+    uint32_t bytes;
+    uint32_t interval;
+    uint16_t received;
+    uint16_t lost;
+};
+
+
+void udprelay_cleanup(udprelay_t *udprelay);
+static void udprelay_flush_bundle(udprelay_t *udprelay);
+
+static bool addr_equal(const char *a, const char *b) {
+    return a == b || (a && b && !strcmp(a, b));
+}
+
+/* Set up encryption, keeping the old one if the new one can't be set up */
+static int udprelay_configure_key(udprelay_t *udprelay, const config_t *config) {
+    if(addr_equal(udprelay->key, config->key) && addr_equal(udprelay->cipher, config->cipher)) return 0;
+
+    aead_t *aead = NULL;
+    if(config->key && !(aead = new_aead(config->cipher, config->key))) return -1;
+
+    if(udprelay->aead) free_aead(udprelay->aead);
+    udprelay->aead = aead;
+    udprelay->overhead = aead ? AEAD_OVERHEAD + AEAD_PATH_LEN : 0;
+
+    if(udprelay->key) free(udprelay->key);
+    if(udprelay->cipher) free(udprelay->cipher);
+    udprelay->key = config->key ? xstrdup(config->key) : NULL;
+    udprelay->cipher = config->cipher ? xstrdup(config->cipher) : NULL;
+
+    if(aead && !udprelay->seal_buf) {
+        udprelay->seal_buf = malloc(sizeof(header_t) + BUF_SZ + AEAD_OVERHEAD + AEAD_PATH_LEN);
+        udprelay->open_buf = malloc(sizeof(header_t) + BUF_SZ);
+    }
+
+    return 0;
+}
+
+static void udprelay_set_compressor(udprelay_t *udprelay, compressor_t *c) {
+    if(udprelay->compressor) free_compressor(udprelay->compressor);
+    udprelay->compressor = c;
+
+    if(c && !udprelay->pack_buf) {
+        udprelay->pack_buf = malloc(sizeof(header_t) + BUF_SZ);
+        udprelay->unpack_buf = malloc(sizeof(header_t) + BUF_SZ);
+    }
+}
+
+/* Set up compression, keeping the old one if the new one can't be set up */
+static int udprelay_configure_compressor(udprelay_t *udprelay, const config_t *config) {
+    if(udprelay->compress == config->compress && addr_equal(udprelay->dictionary, config->dictionary) &&
+        (udprelay->compressor || !config->compress)) return 0;
+
+    compressor_t *c = NULL;
+    if(config->compress && !(c = new_compressor(config->compress, config->dictionary))) return -1;
+
+    udprelay_set_compressor(udprelay, c);
+    udprelay->compressor_failed = false;
+    udprelay->compress = config->compress;
+
+    if(udprelay->dictionary) free(udprelay->dictionary);
+    udprelay->dictionary = config->dictionary ? xstrdup(config->dictionary) : NULL;
+
+    return 0;
+}
+
+/* Peer may compress even if this node doesn't */
+static compressor_t *udprelay_decompressor(udprelay_t *udprelay) {
+    if(!udprelay->compressor && !udprelay->compressor_failed) {
+        compressor_t *c = new_compressor(0, udprelay->dictionary);
+        udprelay->compressor_failed = !c;
+        udprelay_set_compressor(udprelay, c);
+    }
+    return udprelay->compressor;
+}
+
+static void udprelay_capture_relay(udprelay_t *udprelay, relay_t *relay) {
+    if(!udprelay->capture || !capture_active(udprelay->capture)) return;
+
+    char *name;
+    int linktype;
+    if(relay == udprelay->outward) {
+        name = relay->tun ? xstrdup(relay->local_addr) : strdup_printf("outward %s", relay->local_addr ? relay->local_addr : "<unspec>");
+        linktype = relay->tun ? LINKTYPE_RAW : LINKTYPE_USER1;
+    } else {
+        name = strdup_printf("%s-%s", relay->local_addr ? relay->local_addr : "<unspec>",
+            relay->remote_addr ? relay->remote_addr : "<dynamic>");
+        linktype = LINKTYPE_USER0;
+    }
+
+    relay->capture_if = capture_interface(udprelay->capture, name, linktype);
+    relay->capture = udprelay->capture;
+    free(name);
+}
+
+static void udprelay_capture_stop(udprelay_t *udprelay) {
+    if(!udprelay->capture || !capture_active(udprelay->capture)) return;
+
+    relay_t *r;
+    CLIST_FOREACH(r, udprelay->relays) r->capture = NULL;
+    udprelay->outward->capture = NULL;
+
+    capture_stop(udprelay->capture);
+    syslog(LOG_INFO, "Capture stopped");
+}
+
+void udprelay_toggle_capture(udprelay_t *udprelay) {
+    if(!udprelay->capture) {
+        syslog(LOG_WARNING, "Capture file is not configured");
+        return;
+    }
+
+    if(capture_active(udprelay->capture)) {
+        udprelay_capture_stop(udprelay);
+        return;
+    }
+
+    if(capture_start(udprelay->capture) < 0) return;
+
+    udprelay_capture_relay(udprelay, udprelay->outward);
+    relay_t *r;
+    CLIST_FOREACH(r, udprelay->relays) udprelay_capture_relay(udprelay, r);
+}
+
+/* Running capture is stopped if its settings change */
+static void udprelay_configure_capture(udprelay_t *udprelay, const config_t *config) {
+    if(addr_equal(udprelay->capture_path, config->capture) && udprelay->snaplen == config->snaplen) return;
+
+    if(udprelay->capture) {
+        udprelay_capture_stop(udprelay);
+        free_capture(udprelay->capture);
+    }
+    if(udprelay->capture_path) free(udprelay->capture_path);
+
+    udprelay->capture = config->capture ? new_capture(config->capture, config->snaplen) : NULL;
+    udprelay->capture_path = config->capture ? xstrdup(config->capture) : NULL;
+    udprelay->snaplen = config->snaplen;
+}
+
+static void udprelay_free_filter(udprelay_t *udprelay) {
+    if(dedup_filter_dropped(udprelay->filter)) {
+        syslog(LOG_INFO, "%lu copies dropped by kernel", dedup_filter_dropped(udprelay->filter));
+    }
+    free_dedup_filter(udprelay->filter);
+    udprelay->filter = NULL;
+}
+
+/* Filter remembers no more than lookup, relays pick it up in udprelay_configure_relay() */
+static void udprelay_configure_filter(udprelay_t *udprelay, const config_t *config) {
+    if(!config->kernel_dedup) {
+        if(udprelay->filter) udprelay_free_filter(udprelay);
+        return;
+    }
+
+    if(udprelay->filter) {
+        dedup_filter_resize(udprelay->filter, config->track);
+    } else if(!(udprelay->filter = new_dedup_filter(&dedup_header, config->track))) {
+        syslog(LOG_WARNING, "kernel_dedup: %m");
+    }
+}
+
+/* Apply global options, also on reload */
+static void udprelay_configure(udprelay_t *udprelay, const config_t *config) {
+    udprelay->congestion = config->congestion * 1000;
+    udprelay->resolve = (uint64_t)config->resolve * 1000000;
+    udprelay->mode = config->mode;
+    udprelay->copies = config->copies;
+
+    if(udprelay->cpu) free(udprelay->cpu);
+    if(udprelay->sched) free(udprelay->sched);
+    udprelay->cpu = config->cpu ? xstrdup(config->cpu) : NULL;
+    udprelay->sched = config->sched ? xstrdup(config->sched) : NULL;
+    udprelay->mlock = config->mlock;
+
+    udprelay->busy_poll = config->busy_poll;
+    relay_set_busy_poll(udprelay->outward, udprelay->busy_poll);
+
+    /* Bundle buffer is sized by mtu */
+    udprelay_flush_bundle(udprelay);
+    if(udprelay->bundle) free(udprelay->bundle);
+
+    udprelay->mtu = config->mtu;
+    udprelay->bundle_delay = config->bundle;
+    udprelay->bundle = udprelay->bundle_delay ? malloc(udprelay->mtu) : NULL;
+
+    /* Keep recently seen sequence numbers */
+    udprelay->lookup = udprelay->lookup ? lookup_resize(udprelay->lookup, config->track) : new_lookup(config->track);
+    lookup_set_window(udprelay->lookup, (uint64_t)config->skew * 1000);
+    udprelay_configure_filter(udprelay, config);
+
+    if(!udprelay->reasm || udprelay->reassembly != config->reassembly) {
+        if(udprelay->reasm) free_reasm(udprelay->reasm);
+        udprelay->reasm = new_reasm(config->reassembly, sizeof(header_t));
+        udprelay->reassembly = config->reassembly;
+    }
+}
+
+/* Apply relay options, keeping sockets, queues and learned path state */
+static void udprelay_configure_relay(udprelay_t *udprelay, relay_t *relay, const relay_config_t *config) {
+    relay_configure(relay, config);
+
+    if(relay->mtu_limit != udprelay->mtu) relay_set_mtu(relay, udprelay->mtu);
+    relay_set_busy_poll(relay, udprelay->busy_poll);
+    relay_set_filter(relay, udprelay->filter ? dedup_filter_fd(udprelay->filter) : -1);
+
+    if(relay->cc.target != udprelay->congestion) {
+        cc_init(&relay->cc, config->rate / 8, udprelay->congestion);
+    } else {
+        cc_limit(&relay->cc, config->rate / 8);
+    }
+    if(relay->cc.rate) relay_set_rate(relay, relay->cc.rate);
+}
+
+static relay_t *udprelay_add_relay(udprelay_t *udprelay, const relay_config_t *config) {
+    relay_t *relay = new_relay(config);
+    if(!relay) return NULL;
+
+    udprelay_configure_relay(udprelay, relay, config);
+    relay->order = udprelay->relays_added++;
+    udprelay_capture_relay(udprelay, relay);
+
+    CLIST_ADD_LAST(udprelay->relays, relay);
+    udprelay->relays_num++;
+    syslog(LOG_INFO, "Add relay from %s to %s",
+        relay->local_addr ? relay->local_addr : "<unspec>",
+        relay->remote_addr ? relay->remote_addr : "<dynamic>");
+
+    return relay;
+}
+
+int udprelay_init(udprelay_t *udprelay, const char *conf_file) {
+    memset(udprelay, 0, sizeof(udprelay_t));
+
+    config_t *config = parse_config(conf_file);
+    if(!config) {
+        syslog(LOG_ERR, "Incorrect config file");
+        return -1;
+    }
+
+    /* Working directory is changed after daemonizing */
+    udprelay->conf_file = realpath(conf_file, NULL);
+
+    if(!(udprelay->resolver = new_resolver(RESOLVER_THREADS))) {
+        syslog(LOG_ERR, "%m");
+        free_config(config);
+        return -1;
+    }
+
+    /* Add outward interface specified with "listen" and "forward" directives or TUN device */
+    udprelay->outward = config->tun ? new_tun_relay(config->tun) : new_relay(&config->outward);
+    if(!udprelay->outward) {
+        udprelay_cleanup(udprelay);
+        free_config(config);
+        return -1;
+    }
+    
+    if(udprelay->outward->tun) {
+        syslog(LOG_INFO, "Outward interface: TUN device %s", udprelay->outward->local_addr);
+    } else {
+        syslog(LOG_INFO, "Outward interface: listen to %s, forward to %s",
+            udprelay->outward->local_addr ? udprelay->outward->local_addr : "<unspec>",
+            udprelay->outward->remote_addr ? udprelay->outward->remote_addr : "<dynamic>");
+    }
+
+    if(udprelay_configure_key(udprelay, config) < 0 || udprelay_configure_compressor(udprelay, config) < 0) {
+        udprelay_cleanup(udprelay);
+        free_config(config);
+        return -1;
+    }
+    udprelay_configure(udprelay, config);
+    udprelay_configure_capture(udprelay, config);
+
+    /* Add relays */
+    relay_config_t *c;
+    CLIST_FOREACH(c, config->relay_config) {
+        if(!udprelay_add_relay(udprelay, c)) {
+            udprelay_cleanup(udprelay);
+            free_config(config);
+            return -1;
+        }
+    }
+
+    free_config(config);
+
+    return 0;
+}
+
+/* Re-read config and apply changes without dropping unchanged relays */
+int udprelay_reload(udprelay_t *udprelay) {
+    config_t *config = udprelay->conf_file ? parse_config(udprelay->conf_file) : NULL;
+    if(!config) {
+        syslog(LOG_ERR, "Incorrect config file, keep running with old one");
+        return -1;
+    }
+
+    if(udprelay_configure_key(udprelay, config) < 0 || udprelay_configure_compressor(udprelay, config) < 0) {
+        syslog(LOG_ERR, "Keep running with old config");
+        free_config(config);
+        return -1;
+    }
+
+    bool outward_changed = config->tun ?
+        !udprelay->outward->tun || !addr_equal(config->tun, udprelay->outward->local_addr) :
+        udprelay->outward->tun || !addr_equal(config->outward.local_addr, udprelay->outward->local_addr) ||
+        !addr_equal(config->outward.remote_addr, udprelay->outward->remote_addr);
+
+    if(outward_changed) {
+        syslog(LOG_WARNING, "Outward interface can't be changed without restart");
+    }
+
+    udprelay_configure(udprelay, config);
+    udprelay_configure_capture(udprelay, config);
+
+    relay_t *r;
+    CLIST_FOREACH(r, udprelay->relays) {
+        relay_config_t *c, *found = NULL;
+        CLIST_FOREACH(c, config->relay_config) {
+            if(addr_equal(c->local_addr, r->local_addr) && addr_equal(c->remote_addr, r->remote_addr)) {
+                found = c;
+                break;
+            }
+        }
+
+        if(!found) {
+            syslog(LOG_INFO, "Remove relay from %s to %s",
+                r->local_addr ? r->local_addr : "<unspec>",
+                r->remote_addr ? r->remote_addr : "<dynamic>");
+
+            CLIST_DEL(udprelay->relays, r);
+            free_relay(r);
+            udprelay->relays_num--;
+            continue;
+        }
+
+        udprelay_configure_relay(udprelay, r, found);
+
+        /* What is left in config are new relays */
+        CLIST_DEL(config->relay_config, found);
+        free_relay_config(found);
+    }
+
+    relay_config_t *c;
+    CLIST_FOREACH(c, config->relay_config) {
+        udprelay_add_relay(udprelay, c);
+    }
+
+    free_config(config);
+
+    return 0;
+}
+
+void udprelay_cleanup(udprelay_t *udprelay) {
+    relay_t *r;
+    while((r = udprelay->relays) != NULL) {
+        CLIST_DEL(udprelay->relays, r);
+        free_relay(r);
+    }
+    if(udprelay->outward) free_relay(udprelay->outward);
+    if(udprelay->lookup) {
+        if(lookup_late(udprelay->lookup)) {
+            syslog(LOG_INFO, "%lu datagrams arrived too late to tell them from duplicates", lookup_late(udprelay->lookup));
+        }
+        free_lookup(udprelay->lookup);
+    }
+    if(udprelay->filter) udprelay_free_filter(udprelay);
+    if(udprelay->reasm) free_reasm(udprelay->reasm);
+    if(udprelay->bundle) free(udprelay->bundle);
+    if(udprelay->conf_file) free(udprelay->conf_file);
+    if(udprelay->resolver) free_resolver(udprelay->resolver);
+    if(udprelay->aead) free_aead(udprelay->aead);
+    if(udprelay->key) free(udprelay->key);
+    if(udprelay->cipher) free(udprelay->cipher);
+    if(udprelay->seal_buf) free(udprelay->seal_buf);
+    if(udprelay->open_buf) free(udprelay->open_buf);
+    if(udprelay->compressor) free_compressor(udprelay->compressor);
+    if(udprelay->dictionary) free(udprelay->dictionary);
+    if(udprelay->pack_buf) free(udprelay->pack_buf);
+    if(udprelay->unpack_buf) free(udprelay->unpack_buf);
+    if(udprelay->capture) free_capture(udprelay->capture);
+    if(udprelay->capture_path) free(udprelay->capture_path);
+    if(udprelay->cpu) free(udprelay->cpu);
+    if(udprelay->sched) free(udprelay->sched);
+}
+
+/* Start lookup of relay's host name when it is due */
+static void udprelay_resolve(udprelay_t *udprelay, relay_t *relay, uint64_t now) {
+    if(!relay->resolve || relay->resolving || relay->resolve_time > now) return;
+
+    relay->resolving = true;
+    relay->resolve_id = ++udprelay->resolve_id;
+    resolver_submit(udprelay->resolver, relay->remote_addr, relay->v4mapped ? AF_UNSPEC : relay->family, relay, relay->resolve_id);
+}
+
+static uint64_t udprelay_resolve_deadline(relay_t *relay) {
+    return relay->resolve && !relay->resolving ? relay->resolve_time : UINT64_MAX;
+}
+
+/* Relay could have been removed by reload while its lookup was in progress */
+static relay_t *udprelay_find_relay(udprelay_t *udprelay, void *ptr, uint64_t id) {
+    if(ptr == udprelay->outward && udprelay->outward->resolve_id == id) return udprelay->outward;
+
+    relay_t *r;
+    CLIST_FOREACH(r, udprelay->relays) {
+        if(r == ptr && r->resolve_id == id) return r;
+    }
+    return NULL;
+}
+
+/* Apply completed lookups. Address is swapped between datagrams, so it's never seen half-updated */
+static void udprelay_resolved(udprelay_t *udprelay) {
+    uint64_t now = time_usec();
+    resolver_result_t res;
+
+    while(resolver_result(udprelay->resolver, &res)) {
+        relay_t *relay = udprelay_find_relay(udprelay, res.ctx, res.id);
+        if(!relay) continue;
+
+        relay->resolving = false;
+
+        if(res.err) {
+            /* Keep last known address */
+            syslog(LOG_WARNING, "%s: %s", relay->remote_addr, gai_strerror(res.err));
+            relay->resolve_time = now + (relay->remote_sa_len && udprelay->resolve ? udprelay->resolve : RESOLVE_RETRY_USEC);
+            continue;
+        }
+
+        relay_set_remote(relay, (struct sockaddr*)&res.addr, res.addr_len);
+        relay->resolve_time = udprelay->resolve ? now + udprelay->resolve : UINT64_MAX;
+    }
+}
+
+/* Apply rate chosen by congestion controller */
+static void udprelay_pace(relay_t *relay, uint64_t rate) {
+    if(rate && rate != relay->rate) relay_set_rate(relay, rate);
+}
+
+/* Header fields which differ between relays are left out of authentication,
+   so datagram is sealed once and the same copy goes to every relay. They are
+   covered by per-path MAC instead, see udprelay_sign() */
+static void udprelay_aad(header_t *aad, const header_t *hdr) {
+    memset(aad, 0, sizeof(header_t));
+    aad->seq = hdr->seq;
+    aad->type = hdr->type;
+    aad->flags = hdr->flags & HDR_F_COMPRESSED;
+}
+
+/* Seal payload into seal_buf, header is left in clear. Returns sealed length */
+static ssize_t udprelay_seal(udprelay_t *udprelay, const header_t *hdr, size_t length) {
+    header_t aad;
+    udprelay_aad(&aad, hdr);
+
+    memcpy(udprelay->seal_buf, hdr, sizeof(header_t));
+    ssize_t sz = aead_seal(udprelay->aead, udprelay->seal_buf + sizeof(header_t), &aad, sizeof(header_t),
+        hdr->payload, length - sizeof(header_t));
+
+    if(X_UNLIKELY(sz < 0)) {
+        syslog(LOG_ERR, "Can't seal datagram");
+        return -1;
+    }
+
+    return sizeof(header_t) + sz;
+}
+
+/* Open sealed datagram into open_buf. Returns 1 for another copy of datagram which was opened already */
+static int udprelay_open(udprelay_t *udprelay, const header_t **hdr, size_t *sz) {
+    const header_t *sealed = *hdr;
+    size_t length = *sz - sizeof(header_t);
+
+    int ret = aead_check(udprelay->aead, sealed->payload, length);
+    if(ret) return ret;
+
+    header_t aad, *out = (header_t*)udprelay->open_buf;
+    udprelay_aad(&aad, sealed);
+
+    ssize_t len = aead_open(udprelay->aead, out->payload, &aad, sizeof(header_t), sealed->payload, length);
+    if(len < 0) return -1;
+
+    memcpy(out, sealed, sizeof(header_t));
+    *hdr = out;
+    *sz = sizeof(header_t) + len;
+
+    return 0;
+}
+
+/* Parts covered by per-path MAC: length, header with either whole fragment or nonce and tag
+   of sealed payload, the tag authenticates the rest of it. Cost doesn't depend on datagram size */
+static int udprelay_path_iov(const header_t *hdr, size_t length, uint16_t *len, struct iovec *iov) {
+    const uint8_t *body = hdr->payload;
+    size_t body_len = length - sizeof(header_t);
+
+    *len = htons(length);
+    iov[0] = (struct iovec){.iov_base = len, .iov_len = sizeof(*len)};
+    iov[1] = (struct iovec){.iov_base = (void*)hdr, .iov_len = sizeof(header_t)};
+    if(hdr->frags || body_len < AEAD_OVERHEAD) {
+        iov[2] = (struct iovec){.iov_base = (void*)body, .iov_len = body_len};
+        return 3;
+    }
+
+    iov[2] = (struct iovec){.iov_base = (void*)body, .iov_len = AEAD_NONCE_LEN};
+    iov[3] = (struct iovec){.iov_base = (void*)(body + body_len - AEAD_TAG_LEN), .iov_len = AEAD_TAG_LEN};
+    return 4;
+}
+
+/* Append per-path trailer, buffer must have room for it. Returns new length */
+static ssize_t udprelay_sign(udprelay_t *udprelay, relay_t *relay, header_t *hdr, size_t length) {
+    struct iovec iov[4];
+    uint16_t len;
+    int n = udprelay_path_iov(hdr, length, &len, iov);
+
+    if(X_UNLIKELY(aead_sign(udprelay->aead, (uint8_t*)hdr + length, relay->path, iov, n) < 0)) {
+        syslog(LOG_ERR, "Can't sign datagram");
+        return -1;
+    }
+
+    return length + AEAD_PATH_LEN;
+}
+
+/* Check and strip per-path trailer, datagrams replayed to this or another relay fail */
+static int udprelay_verify(udprelay_t *udprelay, relay_t *relay, const header_t *hdr, size_t *sz) {
+    if(*sz < sizeof(header_t) + AEAD_PATH_LEN) return -1;
+
+    size_t length = *sz - AEAD_PATH_LEN;
+    struct iovec iov[4];
+    uint16_t len;
+    int n = udprelay_path_iov(hdr, length, &len, iov);
+
+    if(aead_verify(udprelay->aead, (const uint8_t*)hdr + length, relay->path, &relay->path_window, iov, n) < 0) return -1;
+
+    *sz = length;
+    return 0;
+}
+
+/* Send service datagram through relay, sealing it if encryption is on */
+static int udprelay_transmit(udprelay_t *udprelay, relay_t *relay, const header_t *hdr, size_t length) {
+    if(!udprelay->aead) return relay_enqueue(relay, hdr, length);
+
+    ssize_t sz = udprelay_seal(udprelay, hdr, length);
+    if(sz >= 0) sz = udprelay_sign(udprelay, relay, (header_t*)udprelay->seal_buf, sz);
+    return sz < 0 ? 0 : relay_enqueue(relay, udprelay->seal_buf, sz);
+}
+
+static int udprelay_send_feedback(udprelay_t *udprelay, relay_t *relay, const cc_report_t *report) {
+    uint8_t pkt[sizeof(header_t) + sizeof(feedback_t)] __attribute__((aligned(sizeof(uint32_t))));
+    header_t *hdr = (header_t*)pkt;
+    feedback_t *fb = (feedback_t*)hdr->payload;
+
+    memset(hdr, 0, sizeof(header_t));
+    hdr->type = HDR_FEEDBACK;
+    hdr->ts = htonl(time_usec());
+
+    fb->qdelay = htonl(report->qdelay);
+    fb->bytes = htonl(report->bytes);
+    fb->interval = htonl(report->interval);
+    fb->received = htons(report->received);
+    fb->lost = htons(report->lost);
+
+    return udprelay_transmit(udprelay, relay, hdr, sizeof(pkt));
+}
+
+/* Probes check if relay path works, any datagram from peer is an answer */
+static int udprelay_send_probe(udprelay_t *udprelay, relay_t *relay, int type) {
+    header_t hdr;
+
+    memset(&hdr, 0, sizeof(header_t));
+    hdr.type = type;
+    hdr.ts = htonl(time_usec());
+
+    return udprelay_transmit(udprelay, relay, &hdr, sizeof(header_t));
+}
+
+static int udprelay_dispatch_feedback(relay_t *relay, const header_t *hdr, size_t sz) {
+    if(sz < sizeof(header_t) + sizeof(feedback_t)) return 0; /* Drop */
+
+    const feedback_t *fb = (const feedback_t*)hdr->payload;
+    cc_report_t report = {
+        .qdelay = ntohl(fb->qdelay),
+        .bytes = ntohl(fb->bytes),
+        .interval = ntohl(fb->interval),
+        .received = ntohs(fb->received),
+        .lost = ntohs(fb->lost),
+    };
+
+    udprelay_pace(relay, cc_update(&relay->cc, &report, time_usec()));
+    return 0;
+}
+
+static int udprelay_forward(udprelay_t *udprelay, int seq, const void *payload, size_t sz) {
+    /* Check for duplicates here */
+    if(!lookup_push(udprelay->lookup, seq, time_usec())) {
+        X_DBG("Skip duplicated %d\n", seq);
+        return 0;
+    }
+    X_DBG("Received %d\n", seq);
+    if(udprelay->filter) dedup_filter_mark(udprelay->filter, seq);
+
+    return relay_enqueue(udprelay->outward, payload, sz);
+}
+
+static int udprelay_dispatch_bundle(udprelay_t *udprelay, const header_t *hdr, size_t sz) {
+    const uint8_t *p = hdr->payload;
+    const uint8_t *end = (const uint8_t*)hdr + sz;
+
+    while(p + sizeof(subheader_t) <= end) {
+        subheader_t sub;
+        memcpy(&sub, p, sizeof(subheader_t));
+        p += sizeof(subheader_t);
+
+        size_t length = ntohs(sub.length);
+        if(p + length > end) break; /* Truncated */
+
+        if(X_UNLIKELY(udprelay_forward(udprelay, ntohs(sub.seq), p, length) < 0)) return -1;
+        p += length;
+    }
+
+    return 0;
+}
+
+/* Handle packet received from peers */
+static int udprelay_dispatch_relayed(udprelay_t *udprelay, relay_t *relay, const void *buffer, size_t sz) {
+    X_DBG("%lu bytes\n", (unsigned long)sz);
+
+    /* Without encryption anything coming from peer's address is trusted */
+    if(!udprelay->aead) relay_accept(relay);
+    if(sz < sizeof(header_t)) return 0; /* Drop */
+
+    const header_t *hdr = (header_t*)buffer;
+    size_t wire_sz = sz;
+    bool copy = false;
+
+    /* Forged and replayed datagrams must not reach relay state, congestion control, duplicate
+       window or any other state. Every copy and fragment carries per-path MAC with a counter
+       new to this relay, payload is opened once for all copies */
+    if(udprelay->aead) {
+        if(udprelay_verify(udprelay, relay, hdr, &sz) < 0) {
+            X_DBG("Drop unauthenticated datagram\n");
+            return 0;
+        }
+
+        if(!hdr->frags) {
+            int ret = udprelay_open(udprelay, &hdr, &sz);
+            if(ret < 0) {
+                X_DBG("Drop unauthenticated datagram\n");
+                return 0;
+            }
+            copy = ret > 0;
+        }
+
+        /* First arrival on this path of a datagram opened here or through another relay */
+        relay_accept(relay);
+    }
+
+    if(hdr->type == HDR_FEEDBACK) return copy ? 0 : udprelay_dispatch_feedback(relay, hdr, sz);
+    if(hdr->type == HDR_PROBE) return copy ? 0 : udprelay_send_probe(udprelay, relay, HDR_PROBE_ACK);
+    if(hdr->type != HDR_DATA && hdr->type != HDR_BUNDLE) return 0;
+
+    /* Per relay fields are authenticated by per-path MAC only */
+    if(hdr->flags & HDR_F_CC) {
+        uint64_t now = time_usec();
+        cc_report_t report;
+
+        /* One-way delay up to arrival, time spent in event loop is not queuing on the path */
+        cc_received(&relay->cc, ntohs(hdr->pseq), ntohl(hdr->ts), wire_sz, relay->recv_time);
+        if(cc_report(&relay->cc, now, &report) && udprelay_send_feedback(udprelay, relay, &report) < 0) {
+            return -1;
+        }
+    }
+
+    /* Copy which came through another relay */
+    if(copy) return 0;
+
+    if(hdr->frags) {
+        /* Fragments of already delivered datagram */
+        if(lookup_seen(udprelay->lookup, ntohs(hdr->seq))) return 0;
+
+        void *pkt;
+        ssize_t len = reasm_push(udprelay->reasm, ntohs(hdr->seq) | hdr->type << 16, hdr->frag, hdr->frags,
+            hdr->payload, sz - sizeof(header_t), &pkt);
+        if(len <= 0) return 0;
+
+        /* Complete datagram, restore header */
+        header_t *full = (header_t*)pkt;
+        memcpy(full, hdr, sizeof(header_t));
+        full->frag = full->frags = 0;
+
+        hdr = full;
+        sz = sizeof(header_t) + len;
+
+        if(udprelay->aead && udprelay_open(udprelay, &hdr, &sz) != 0) return 0;
+    }
+
+    if(hdr->flags & HDR_F_COMPRESSED) {
+        /* Don't waste time on copies which came through other relays */
+        if(lookup_seen(udprelay->lookup, ntohs(hdr->seq))) return 0;
+
+        compressor_t *c = udprelay_decompressor(udprelay);
+        if(!c) return 0;
+
+        header_t *full = (header_t*)udprelay->unpack_buf;
+        ssize_t len = compressor_unpack(c, full->payload, BUF_SZ, hdr->payload, sz - sizeof(header_t));
+        if(len < 0) {
+            X_DBG("Can't decompress %d\n", ntohs(hdr->seq));
+            return 0;
+        }
+
+        memcpy(full, hdr, sizeof(header_t));
+        hdr = full;
+        sz = sizeof(header_t) + len;
+    }
+
+    if(hdr->type == HDR_BUNDLE) return udprelay_dispatch_bundle(udprelay, hdr, sz);
+
+    /* Strip header and forward */
+    return udprelay_forward(udprelay, ntohs(hdr->seq), &hdr->payload, sz - sizeof(header_t));
+}
+
+static void udprelay_header(udprelay_t *udprelay, header_t *hdr, int type, uint16_t seq) {
+    memset(hdr, 0, sizeof(header_t));
+    hdr->seq = htons(seq);
+    hdr->type = type;
+    hdr->flags = udprelay->congestion ? HDR_F_CC : 0;
+    hdr->ts = htonl(time_usec());
+#ifdef DEBUG
+    hdr->pkts_in_series = htons(udprelay->relays_num);
+#endif
+}
+
+/* Split datagram exceeding path MTU into fragments of equal size, last one may be shorter */
+static int udprelay_send_fragments(udprelay_t *udprelay, relay_t *relay, const header_t *hdr, size_t length, size_t mtu) {
+    size_t trailer = udprelay->aead ? AEAD_PATH_LEN : 0;
+    size_t payload = length - sizeof(header_t);
+    size_t room = mtu - sizeof(header_t) - trailer;
+
+    int frags = (payload + room - 1) / room;
+    size_t frag_size = (payload + frags - 1) / frags;
+    frags = (payload + frag_size - 1) / frag_size;
+
+    if(X_UNLIKELY(frags > MAX_FRAGS)) {
+        syslog(LOG_WARNING, "%lu bytes datagram doesn't fit into %d fragments", (unsigned long)length, MAX_FRAGS);
+        return 0;
+    }
+
+    uint8_t pkt[sizeof(header_t) + frag_size + trailer] __attribute__((aligned(sizeof(uint32_t))));
+    header_t *fhdr = (header_t*)pkt;
+    memcpy(fhdr, hdr, sizeof(header_t));
+    fhdr->frags = frags;
+
+    int i;
+    for(i = 0; i < frags; i++) {
+        size_t offset = i * frag_size;
+        size_t sz = MIN(frag_size, payload - offset);
+
+        fhdr->frag = i;
+        fhdr->pseq = htons(relay->pseq++);
+        memcpy(fhdr->payload, hdr->payload + offset, sz);
+
+        ssize_t len = sizeof(header_t) + sz;
+        if(udprelay->aead && (len = udprelay_sign(udprelay, relay, fhdr, len)) < 0) return 0;
+
+        if(X_UNLIKELY(relay_enqueue(relay, fhdr, len) < 0)) return -1;
+    }
+
+    return 0;
+}
+
+/* Datagram is already sealed if encryption is on, buffer has room for per-path trailer then */
+static int udprelay_send(udprelay_t *udprelay, relay_t *relay, header_t *hdr, size_t length) {
+    size_t trailer = udprelay->aead ? AEAD_PATH_LEN : 0;
+    size_t mtu = relay_mtu(relay);
+
+    if(!mtu || length + trailer <= mtu) {
+        hdr->pseq = htons(relay->pseq++);
+
+        ssize_t sz = udprelay->aead ? udprelay_sign(udprelay, relay, hdr, length) : (ssize_t)length;
+        if(sz < 0) return 0;
+
+        int ret = relay_enqueue(relay, hdr, sz);
+        /* Unless path MTU has just shrunk */
+        if(ret < 0 || !relay->mtu || (size_t)sz <= relay->mtu) return ret;
+
+        mtu = relay->mtu;
+    }
+
+    return udprelay_send_fragments(udprelay, relay, hdr, length, mtu);
+}
+
+/* Send datagram with filled header to every relay */
+static void udprelay_broadcast(udprelay_t *udprelay, header_t *hdr, size_t length) {
+    uint64_t now = time_usec();
+
+    int i = 0, sent = 0;
+    relay_t *r, *congested = NULL;
+    /* Circular list can be iterated starting from any member */
+    CLIST_FOREACH(r, udprelay->relays) {
+#ifdef DEBUG
+        hdr->pkt_num = htons(i);
+#endif
+        if(!relay_active(r)) {
+            i++;
+            continue;
+        }
+
+        if(udprelay->congestion) {
+            udprelay_pace(r, cc_check(&r->cc, now));
+
+            /* Leave this copy to healthier paths instead of growing the queue */
+            if(relay_congested(r)) {
+                if(!congested || r->queue_len < congested->queue_len) congested = r;
+                i++;
+                continue;
+            }
+        }
+
+        if(X_UNLIKELY(udprelay_send(udprelay, r, hdr, length) < 0)) {
+            relay_down(r);
+        } else {
+            X_DBG("Sent %d (%d of %d), %lu bytes\n", ntohs(hdr->seq), i, udprelay->relays_num, (unsigned long)length);
+            sent++;
+        }
+        i++;
+    }
+
+    /* Every path is congested, queue on the least loaded one */
+    if(!sent && congested && X_UNLIKELY(udprelay_send(udprelay, congested, hdr, length) < 0)) {
+        relay_down(congested);
+    }
+
+    if(udprelay->relays) udprelay->relays = udprelay->relays->_next; /* Round-robin trip */
+}
+
+/* Negative if relay a is better: answering peer, not congested, heavier.
+   Backup mode keeps config order among equals, k-of-n prefers shorter queue */
+static int udprelay_rank(udprelay_t *udprelay, relay_t *a, relay_t *b) {
+    if(a->state != b->state) return a->state == RELAY_UP ? -1 : 1;
+
+    if(udprelay->congestion) {
+        bool ca = relay_congested(a), cb = relay_congested(b);
+        if(ca != cb) return ca ? 1 : -1;
+    }
+
+    if(a->weight != b->weight) return b->weight - a->weight;
+    return udprelay->mode == MODE_BACKUP ? a->order - b->order : a->queue_len - b->queue_len;
+}
+
+/* Smooth weighted round-robin, congested relays are used only if all of them are */
+static relay_t *udprelay_wrr(udprelay_t *udprelay, relay_t **cand, int n) {
+    bool uncongested = false;
+    int i;
+
+    if(udprelay->congestion) {
+        for(i = 0; i < n && !uncongested; i++) uncongested = !relay_congested(cand[i]);
+    }
+
+    relay_t *best = NULL;
+    int total = 0;
+    for(i = 0; i < n; i++) {
+        if(uncongested && relay_congested(cand[i])) continue;
+
+        cand[i]->wrr_current += cand[i]->weight;
+        total += cand[i]->weight;
+        if(!best || cand[i]->wrr_current > best->wrr_current) best = cand[i];
+    }
+
+    best->wrr_current -= total;
+    return best;
+}
+
+/* Send datagram with filled header to relays chosen by scheduling mode */
+static void udprelay_fanout(udprelay_t *udprelay, header_t *hdr, size_t length) {
+    /* Compress and seal once for all relays */
+    size_t packed = udprelay->compress ? compressor_pack(udprelay->compressor, udprelay->pack_buf + sizeof(header_t),
+        hdr->payload, length - sizeof(header_t)) : 0;
+
+    if(packed) {
+        X_DBG("Compressed %lu to %lu bytes\n", (unsigned long)(length - sizeof(header_t)), (unsigned long)packed);
+        memcpy(udprelay->pack_buf, hdr, sizeof(header_t));
+        hdr = (header_t*)udprelay->pack_buf;
+        hdr->flags |= HDR_F_COMPRESSED;
+        length = sizeof(header_t) + packed;
+    }
+
+    if(udprelay->aead) {
+        ssize_t sz = udprelay_seal(udprelay, hdr, length);
+        if(sz < 0) return;
+
+        hdr = (header_t*)udprelay->seal_buf;
+        length = sz;
+    }
+
+    if(udprelay->mode == MODE_BROADCAST || !udprelay->relays_num) {
+        udprelay_broadcast(udprelay, hdr, length);
+        return;
+    }
+
+    uint64_t now = time_usec();
+    relay_t *cand[udprelay->relays_num];
+    int n = 0;
+
+    relay_t *r;
+    CLIST_FOREACH(r, udprelay->relays) {
+        if(!relay_active(r)) continue;
+
+        if(udprelay->congestion) udprelay_pace(r, cc_check(&r->cc, now));
+        cand[n++] = r;
+    }
+    if(!n) return;
+
+    int i, copies;
+    if(udprelay->mode == MODE_WEIGHTED) {
+        cand[0] = udprelay_wrr(udprelay, cand, n);
+        copies = 1;
+    } else {
+        copies = udprelay->mode == MODE_BACKUP ? 1 : MIN(udprelay->copies, n);
+
+        /* Partial selection sort, stable so ties keep list order */
+        for(i = 0; i < copies; i++) {
+            int j, best = i;
+            for(j = i + 1; j < n; j++) {
+                if(udprelay_rank(udprelay, cand[j], cand[best]) < 0) best = j;
+            }
+
+            r = cand[best];
+            memmove(&cand[i + 1], &cand[i], (best - i) * sizeof(relay_t*));
+            cand[i] = r;
+        }
+    }
+
+    for(i = 0; i < copies; i++) {
+        r = cand[i];
+
+        /* Don't queue extra copies on congested paths */
+        if(i && udprelay->congestion && relay_congested(r)) break;
+
+#ifdef DEBUG
+        hdr->pkt_num = htons(i);
+#endif
+        if(X_UNLIKELY(udprelay_send(udprelay, r, hdr, length) < 0)) {
+            relay_down(r);
+        } else {
+            X_DBG("Sent %d (%d of %d), %lu bytes\n", ntohs(hdr->seq), i, copies, (unsigned long)length);
+        }
+    }
+
+    /* Spread ties over relays */
+    if(udprelay->mode == MODE_KOFN) udprelay->relays = udprelay->relays->_next;
+}
+
+static void udprelay_flush_bundle(udprelay_t *udprelay) {
+    if(!udprelay->bundle_count) return;
+
+    header_t *hdr = (header_t*)udprelay->bundle;
+    subheader_t sub;
+    memcpy(&sub, hdr->payload, sizeof(subheader_t));
+
+    if(udprelay->bundle_count == 1) {
+        /* Lone datagram doesn't need sub-header */
+        size_t length = ntohs(sub.length);
+        memmove(hdr->payload, hdr->payload + sizeof(subheader_t), length);
+
+        udprelay_header(udprelay, hdr, HDR_DATA, ntohs(sub.seq));
+        udprelay_fanout(udprelay, hdr, sizeof(header_t) + length);
+    } else {
+        udprelay_header(udprelay, hdr, HDR_BUNDLE, ntohs(sub.seq));
+        udprelay_fanout(udprelay, hdr, udprelay->bundle_len);
+    }
+
+    udprelay->bundle_count = 0;
+    udprelay->bundle_len = 0;
+}
+
+/* Microseconds left until bundle must be sent, host name looked up or standby relay probed, -1 if nothing is pending */
+static int64_t udprelay_timeout(udprelay_t *udprelay, uint64_t now) {
+    uint64_t deadline = udprelay_resolve_deadline(udprelay->outward);
+    if(udprelay->bundle_count) deadline = MIN(deadline, udprelay->bundle_time + udprelay->bundle_delay);
+
+    relay_t *r;
+    CLIST_FOREACH(r, udprelay->relays) {
+        deadline = MIN(deadline, udprelay_resolve_deadline(r));
+        if(udprelay->mode != MODE_BROADCAST && r->state == RELAY_UP && !r->dynamic_out_addr) {
+            deadline = MIN(deadline, r->send_time + KEEPALIVE_USEC);
+        }
+    }
+
+    if(deadline == UINT64_MAX) return -1;
+    return deadline > now ? (int64_t)(deadline - now) : 0;
+}
+
+void udprelay_timer(udprelay_t *udprelay, uint64_t now) {
+    if(udprelay->bundle_count && now >= udprelay->bundle_time + udprelay->bundle_delay) udprelay_flush_bundle(udprelay);
+
+    udprelay_resolve(udprelay, udprelay->outward, now);
+
+    /* Relay state machines */
+    relay_t *r;
+    CLIST_FOREACH(r, udprelay->relays) {
+        bool probe = relay_update(r, now);
+
+        /* Relays left idle by scheduling must stay ready to take over */
+        if(udprelay->mode != MODE_BROADCAST && r->state == RELAY_UP && !r->dynamic_out_addr &&
+            now - r->send_time >= KEEPALIVE_USEC) probe = true;
+
+        if(probe && X_UNLIKELY(udprelay_send_probe(udprelay, r, HDR_PROBE) < 0)) {
+            relay_down(r);
+        }
+        udprelay_resolve(udprelay, r, now);
+    }
+}
+
+/* Append small datagram to bundle */
+static void udprelay_bundle(udprelay_t *udprelay, const void *buffer, size_t sz) {
+    size_t entry = sizeof(subheader_t) + sz;
+
+    if(udprelay->bundle_len + entry + udprelay->overhead > udprelay->mtu) udprelay_flush_bundle(udprelay);
+
+    if(!udprelay->bundle_count) {
+        udprelay->bundle_len = sizeof(header_t);
+        udprelay->bundle_time = time_usec();
+    }
+
+    subheader_t sub = {.seq = htons(udprelay->seq++), .length = htons(sz)};
+    memcpy(udprelay->bundle + udprelay->bundle_len, &sub, sizeof(subheader_t));
+    memcpy(udprelay->bundle + udprelay->bundle_len + sizeof(subheader_t), buffer, sz);
+    udprelay->bundle_len += entry;
+    udprelay->bundle_count++;
+
+    if(udprelay->bundle_len + sizeof(subheader_t) + udprelay->overhead >= udprelay->mtu) udprelay_flush_bundle(udprelay);
+}
+
+/* Handle packet received from outward interface */
+static int udprelay_dispatch_inbound(udprelay_t *udprelay, const void *buffer, size_t sz) {
+    if(udprelay->bundle_delay) {
+        if(sizeof(header_t) + sizeof(subheader_t) + sz <= udprelay->mtu / 2) {
+            udprelay_bundle(udprelay, buffer, sz);
+            return 0;
+        }
+
+        /* Keep order, bundled datagrams go first */
+        udprelay_flush_bundle(udprelay);
+    }
+
+    uint8_t pkt[sizeof(header_t) + sz] __attribute__((aligned(sizeof(uint32_t))));
+    header_t *hdr = (header_t*)pkt;
+
+    udprelay_header(udprelay, hdr, HDR_DATA, udprelay->seq++);
+    memcpy(hdr->payload, buffer, sz);
+
+    udprelay_fanout(udprelay, hdr, sizeof(header_t) + sz);
+
+    return 0;    
+}
+
+/* Fill fd sets for select(), returns timeout in usec or -1 */
+int64_t udprelay_fd_set(udprelay_t *udprelay, fd_set *rfds, fd_set *wfds, int *maxfd, uint64_t now) {
+    int64_t timeout = -1;
+
+    relay_t *r;
+    CLIST_FOREACH(r, udprelay->relays) {
+        relay_fd_set(r, rfds, wfds);
+        *maxfd = MAX(*maxfd, r->fd);
+
+        /* Wake up when paced relay may send again */
+        int64_t t = relay_timeout(r, now);
+        if(t >= 0 && (timeout < 0 || t < timeout)) timeout = t;
+    }
+
+    relay_fd_set(udprelay->outward, rfds, wfds);
+    *maxfd = MAX(*maxfd, udprelay->outward->fd);
+
+    int fd = resolver_fd(udprelay->resolver);
+    FD_SET(fd, rfds);
+    *maxfd = MAX(*maxfd, fd);
+
+    int64_t t = udprelay_timeout(udprelay, now);
+    if(t >= 0 && (timeout < 0 || t < timeout)) timeout = t;
+
+    return timeout;
+}
+
+/* Handle ready descriptors, returns number of datagrams received or -1 on fatal error of outward
+   interface. Descriptors are non-blocking, so ones in sets which are not ready are fine */
+int udprelay_handle(udprelay_t *udprelay, const fd_set *rfds, const fd_set *wfds) {
+    int received = 0;
+
+    if(FD_ISSET(resolver_fd(udprelay->resolver), rfds)) udprelay_resolved(udprelay);
+
+    /* Handle outward interface */
+    if(X_UNLIKELY(relay_handle(udprelay->outward, rfds, wfds) < 0)) {
+        return -1;
+    }
+
+    /* Handle relays */
+    relay_t *r;
+    CLIST_FOREACH(r, udprelay->relays) {
+        if(X_UNLIKELY(relay_handle(r, rfds, wfds) < 0)) {
+            relay_down(r);
+        }
+    }
+
+    /* Dispatch inbound */
+    void *buffer;
+    ssize_t sz = relay_receive(udprelay->outward, &buffer);
+    if(sz) {
+        received++;
+        relay_accept(udprelay->outward);
+        if(X_UNLIKELY(udprelay_dispatch_inbound(udprelay, buffer, sz) < 0)) {
+            return -1;
+        }
+    }
+
+    /* Dispatch relayed */
+    CLIST_FOREACH(r, udprelay->relays) {
+        void *buffer;
+        ssize_t sz = relay_receive(r, &buffer);
+        if(!sz) continue;
+
+        received++;
+        if(X_UNLIKELY(udprelay_dispatch_relayed(udprelay, r, buffer, sz) < 0)) {
+            relay_down(r);
+        }
+    }
+
+    return received;
+}
@@ -0,0 +1,94 @@
+#ifndef UDPRELAY_H
+#define UDPRELAY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/select.h>
+
+#include "relay.h"
+#include "seen_lookup.h"
+#include "dedup_filter.h"
+#include "reasm.h"
+#include "resolver.h"
+#include "aead.h"
+#include "compressor.h"
+#include "capture.h"
+
+typedef struct _udprelay_t udprelay_t;
+
+struct _udprelay_t {
+    relay_t *outward;
+    relay_t *relays;
+
+    char *conf_file;
+
+    lookup_t *lookup;
+    /* Copies of what lookup accepted are dropped by kernel (NULL = disabled) */
+    dedup_filter_t *filter;
+    reasm_t *reasm;
+    int reassembly;
+
+    int relays_num;
+    int relays_added;
+    uint16_t seq;
+
+    relay_mode_t mode;
+    int copies;
+
+    /* Authenticated encryption with pre-shared key (NULL = disabled) */
+    aead_t *aead;
+    char *key;
+    char *cipher;
+    size_t overhead;
+    uint8_t *seal_buf;
+    uint8_t *open_buf;
+
+    /* Payload compression (0 = disabled), compressor is set up to decompress only
+       on first compressed datagram when it's disabled */
+    compressor_t *compressor;
+    bool compressor_failed;
+    int compress;
+    char *dictionary;
+    uint8_t *pack_buf;
+    uint8_t *unpack_buf;
+
+    /* Target queuing delay, usec (0 = congestion control disabled) */
+    uint32_t congestion;
+
+    /* Max size of relayed datagram */
+    size_t mtu;
+
+    /* Small datagrams waiting to be sent in one relayed datagram */
+    uint32_t bundle_delay;
+    uint8_t *bundle;
+    size_t bundle_len;
+    int bundle_count;
+    uint64_t bundle_time;
+
+    /* Asynchronous lookups of relays' host names */
+    resolver_t *resolver;
+    uint64_t resolve;
+    uint64_t resolve_id;
+
+    /* Packet capture toggled by SIGUSR1 (NULL = not configured) */
+    capture_t *capture;
+    char *capture_path;
+    int snaplen;
+
+    /* Spin on sockets for up to N usec before sleeping (0 = disabled), applied by event loop */
+    uint32_t busy_poll;
+    /* CPU list, scheduling policy (NULL = default) and memory locking, applied by event loop */
+    char *cpu;
+    char *sched;
+    int mlock;
+};
+
+int udprelay_init(udprelay_t *udprelay, const char *conf_file);
+int udprelay_reload(udprelay_t *udprelay);
+void udprelay_cleanup(udprelay_t *udprelay);
+void udprelay_toggle_capture(udprelay_t *udprelay);
+int64_t udprelay_fd_set(udprelay_t *udprelay, fd_set *rfds, fd_set *wfds, int *maxfd, uint64_t now);
+void udprelay_timer(udprelay_t *udprelay, uint64_t now);
+int udprelay_handle(udprelay_t *udprelay, const fd_set *rfds, const fd_set *wfds);
+
+#endif
@@ -32,161 +32,109 @@ SOFTWARE.
 #include <unistd.h>
 #include <getopt.h>
 #include <sys/select.h>
-#include <arpa/inet.h>
 #include <errno.h>
-#include <inttypes.h>
 
 #include "debug.h"
-#include "config.h"
 #include "utils.h"
-#include "relay.h"
-#include "seen_lookup.h"
+#include "udprelay.h"
 
-typedef struct _udprelay_t udprelay_t;
-typedef struct _header_t header_t;
-
-struct _header_t {
-    uint16_t seq;
-#ifdef DEBUG
-    uint16_t pkt_num;
-    uint16_t pkts_in_series;
-#endif
-    uint8_t payload[0];
-};
+static volatile bool sigterm_evt = false;
+static void sigterm_handler(int signum) {
+    sigterm_evt = true;
+}
 
-struct _udprelay_t
-{
-    relay_t *outward;
-    relay_t *relays;
+static volatile bool sighup_evt = false;
+static void sighup_handler(int signum) {
+    sighup_evt = true;
+}
 
-    lookup_t *lookup;
+static volatile bool sigusr1_evt = false;
+static void sigusr1_handler(int signum) {
+    sigusr1_evt = true;
+}
 
-    int relays_num;
-    uint16_t seq;
-};
+static volatile bool sigusr2_evt = false;
+static void sigusr2_handler(int signum) {
+    sigusr2_evt = true;
+}
 
-static void udprelay_cleanup(udprelay_t *udprelay);
+/* Shortest spin of adaptive busy poll, usec */
+#define MIN_SPIN_USEC 10
 
-static int udprelay_init(udprelay_t *udprelay, const char *conf_file) {
-    memset(udprelay, 0, sizeof(udprelay_t));
+/* Spinning skips pselect(), it's only called this often to take signals, usec */
+#define SPIN_SIGNAL_USEC 1000
 
-    config_t *config = parse_config(conf_file);
-    if(!config) {
-        syslog(LOG_ERR, "Incorrect config file");
-        return -1;
-    }
+/* Where event loop spends its time, to tune busy poll */
+typedef struct {
+    uint64_t busy;      /* Handling ready descriptors and timers */
+    uint64_t spin;      /* Polling and finding nothing */
+    uint64_t sleep;     /* Blocked in pselect() */
+    unsigned long iterations;
+    unsigned long busy_iterations;
+    unsigned long sleeps;
+} loop_stats_t;
 
-    /* Add outward interface specified with "listen" and "forward" directives */
-    udprelay->outward = new_relay(&config->outward);
-    if(!udprelay->outward) {
-        free_config(config);
-        return -1;
-    }
-    
-    syslog(LOG_INFO, "Outward interface: listen to %s, forward to %s",
-        udprelay->outward->local_addr ? udprelay->outward->local_addr : "<unspec>",
-        udprelay->outward->remote_addr ? udprelay->outward->remote_addr : "<dynamic>");
-
-    /* Add relays */
-    relay_config_t *c;
-    CLIST_FOREACH(c, config->relay_config) {
-        relay_t *relay = new_relay(c);
-        if(!relay) {
-            udprelay_cleanup(udprelay);
-            free_config(config);
-            return -1;
-        }
+static void loop_stats_report(loop_stats_t *stats, uint32_t spin_limit) {
+    double total = MAX(stats->busy + stats->spin + stats->sleep, 1);
 
-        CLIST_ADD_LAST(udprelay->relays, relay);
-        udprelay->relays_num++;
-        syslog(LOG_INFO, "Add relay from %s to %s",
-            relay->local_addr ? relay->local_addr : "<unspec>",
-            relay->remote_addr ? relay->remote_addr : "<dynamic>");
-    }
+    syslog(LOG_INFO, "Event loop: %lu iterations, busy %.1f%%, spinning %.1f%%, sleeping %.1f%% (%lu times), "
+        "%.1f usec per busy iteration, spin limit %u usec",
+        stats->iterations, stats->busy * 100 / total, stats->spin * 100 / total, stats->sleep * 100 / total,
+        stats->sleeps, stats->busy_iterations ? (double)stats->busy / stats->busy_iterations : 0.0, spin_limit);
 
-    udprelay->lookup = new_lookup(config->track);
+    memset(stats, 0, sizeof(loop_stats_t));
+}
 
-    free_config(config);
+/* CPU affinity, scheduling and memory locking of event loop, command line overrides config */
+typedef struct {
+    char *cpu;
+    char *sched;
+    int mlock;
+} tuning_t;
 
-    return 0;
+static bool tuning_changed(const char *a, const char *b) {
+    return a && b ? strcmp(a, b) != 0 : a != b;
 }
 
-static void udprelay_cleanup(udprelay_t *udprelay) {
-    relay_t *r;
-    while((r = udprelay->relays) != NULL) {
-        CLIST_DEL(udprelay->relays, r);
-        free_relay(r);
-    }
-    if(udprelay->outward) free_relay(udprelay->outward);
-    if(udprelay->lookup) free_lookup(udprelay->lookup);
-}
+/* Apply settings which differ from current ones */
+static void tuning_apply(tuning_t *cur, const tuning_t *cmdline, const udprelay_t *udprelay) {
+    const char *cpu = cmdline->cpu ? cmdline->cpu : udprelay->cpu;
+    const char *sched = cmdline->sched ? cmdline->sched : udprelay->sched;
+    int mlock = cmdline->mlock || udprelay->mlock;
 
-/* Handle packet received from peers */
-static int udprelay_dispatch_relayed(udprelay_t *udprelay, const void *buffer, size_t sz) {
-    X_DBG("%lu bytes\n", (unsigned long)sz);
-    if(sz < sizeof(header_t)) return 0; /* Drop */
-
-    const header_t *hdr = (header_t*)buffer;
-    
-    int seq = ntohs(hdr->seq);
-    /* Check for duplicates here */
-    if(!lookup_push(udprelay->lookup, seq)) {
-        X_DBG("Skip duplicated %d (%d of %d)\n", seq, ntohs(hdr->pkt_num), ntohs(hdr->pkts_in_series));
-        return 0;
+    if(tuning_changed(cur->cpu, cpu)) {
+        if(set_cpus(cpu) < 0) {
+            syslog(LOG_WARNING, "Can't set CPU affinity %s: %m", cpu ? cpu : "<any>");
+        } else {
+            syslog(LOG_INFO, "Running on CPUs %s", cpu ? cpu : "<any>");
+        }
+        if(cur->cpu) free(cur->cpu);
+        cur->cpu = cpu ? xstrdup(cpu) : NULL;
     }
-    X_DBG("Received %d\n", seq);
-
-    /* Strip header and forward */
-    return relay_enqueue(udprelay->outward, &hdr->payload, sz - sizeof(header_t));
-}
 
-/* Handle packet received from outward interface */
-static int udprelay_dispatch_inbound(udprelay_t *udprelay, const void *buffer, size_t sz) {
-    uint8_t pkt[sizeof(header_t) + sz] __attribute__((aligned(sizeof(uint16_t))));
-    header_t *hdr = (header_t*)pkt;
-
-    memcpy(hdr->payload, buffer, sz);
-    hdr->seq = htons(udprelay->seq);
-#ifdef DEBUG
-    hdr->pkts_in_series = htons(udprelay->relays_num);
-#endif
-
-    int i = 0;
-    relay_t *r;
-    /* Circular list can be iterated starting from any member */
-    CLIST_FOREACH(r, udprelay->relays) {
-#ifdef DEBUG
-        hdr->pkt_num = htons(i);
-#endif
-        if(X_UNLIKELY(relay_enqueue(r, hdr, sizeof(header_t) + sz) < 0)) {
-            syslog(LOG_WARNING, "Relay disabled");
-            
-            /* Remove from list */
-            CLIST_DEL(udprelay->relays, r);
-            free_relay(r);
-            udprelay->relays_num--;
+    if(tuning_changed(cur->sched, sched)) {
+        if(set_sched(sched) < 0) {
+            syslog(LOG_WARNING, "Can't set scheduling policy %s: %m", sched ? sched : "other");
         } else {
-            X_DBG("Sent %d (%d of %d), %lu bytes\n", udprelay->seq, i, udprelay->relays_num, sizeof(header_t) + (unsigned long)sz);
+            syslog(LOG_INFO, "Scheduling policy %s", sched ? sched : "other");
         }
-        i++;
+        if(cur->sched) free(cur->sched);
+        cur->sched = sched ? xstrdup(sched) : NULL;
     }
 
-    udprelay->seq++;
-    udprelay->relays = udprelay->relays->_next; /* Round-robin trip */
-
-    return 0;    
-}
-
-/* ----------------------------------------------------------------------------- */
-
-static volatile bool sigterm_evt = false;
-static void sigterm_handler(int signum) {
-    sigterm_evt = true;
+    if(cur->mlock != mlock) {
+        if(lock_memory(mlock) < 0) {
+            syslog(LOG_WARNING, "Can't %s memory: %m", mlock ? "lock" : "unlock");
+        } else {
+            syslog(LOG_INFO, "Memory %s", mlock ? "locked" : "unlocked");
+        }
+        cur->mlock = mlock;
+    }
 }
 
 static void usage(const char *argv0) {
     char *tmp = xstrdup(argv0);
-    printf("Usage: %s [-d|--detach] [-p|--pidfile pidfile] config\n", basename(tmp));
+    printf("Usage: %s [-d|--detach] [-p|--pidfile pidfile] [-c|--cpu list] [-s|--sched policy[:priority]] [-m|--mlock] config\n", basename(tmp));
     free(tmp);
 }
 
@@ -195,15 +143,19 @@ int main(int argc, char **argv) {
         {"detach",  no_argument,        NULL,   'd'},
         {"help",    no_argument,        NULL,   'h'},
         {"pidfile", required_argument,  NULL,   'p'},
+        {"cpu",     required_argument,  NULL,   'c'},
+        {"sched",   required_argument,  NULL,   's'},
+        {"mlock",   no_argument,        NULL,   'm'},
         {NULL, 0, NULL, 0}
     };
 
     const char *conf_file = NULL;
     const char *pid_file = NULL;
     bool detach = false;
+    tuning_t cmdline = {0}, tuning = {0};
 
     int ch;
-    while((ch = getopt_long(argc, argv, "dhp:", longopts, NULL)) != -1) {
+    while((ch = getopt_long(argc, argv, "dhp:c:s:m", longopts, NULL)) != -1) {
         switch(ch) {
             case 'd':
                 detach = true;
@@ -213,6 +165,18 @@ int main(int argc, char **argv) {
                 pid_file = optarg;
                 break;
 
+            case 'c':
+                cmdline.cpu = optarg;
+                break;
+
+            case 's':
+                cmdline.sched = optarg;
+                break;
+
+            case 'm':
+                cmdline.mlock = 1;
+                break;
+
             case 'h':
             default:
                 usage(argv[0]);
@@ -236,81 +200,133 @@ int main(int argc, char **argv) {
 
     if(detach) xdaemon(pid_file);
 
+    /* Memory locks are not inherited by forked child */
+    tuning_apply(&tuning, &cmdline, &udprelay);
+
     void (*old_sigterm)(int);
     void (*old_sigint)(int);
     old_sigterm = signal(SIGTERM, sigterm_handler);
     old_sigint = signal(SIGINT, sigterm_handler);
+    signal(SIGHUP, sighup_handler);
+    signal(SIGUSR1, sigusr1_handler);
+    signal(SIGUSR2, sigusr2_handler);
+
+    /* Signals are delivered only while waiting in pselect() */
+    sigset_t sigmask, orig_sigmask;
+    sigemptyset(&sigmask);
+    sigaddset(&sigmask, SIGTERM);
+    sigaddset(&sigmask, SIGINT);
+    sigaddset(&sigmask, SIGHUP);
+    sigaddset(&sigmask, SIGUSR1);
+    sigaddset(&sigmask, SIGUSR2);
+    sigprocmask(SIG_BLOCK, &sigmask, &orig_sigmask);
 
     /* main loop */
     fd_set rfds, wfds;
 
+    /* Busy poll: keep polling while something was handled within spin limit, which
+       grows when sleeping ends soon after and shrinks when spinning would not have helped */
+    uint32_t spin_limit = udprelay.busy_poll;
+    uint64_t work_time = 0, signal_time = 0;
+
+    loop_stats_t stats = {0};
+
     while(1) {
         FD_ZERO(&rfds);
         FD_ZERO(&wfds);
 
+        uint64_t now = time_usec();
         int maxfd = 0;
+        int64_t timeout = udprelay_fd_set(&udprelay, &rfds, &wfds, &maxfd, now);
 
-        relay_t *r;
-        CLIST_FOREACH(r, udprelay.relays) {
-            relay_fd_set(r, &rfds, &wfds);
-            maxfd = MAX(maxfd, r->fd);
+        bool spin = udprelay.busy_poll && now - work_time < spin_limit;
+        int ret, err = 0;
+
+        if(spin && now - signal_time < SPIN_SIGNAL_USEC) {
+            /* Descriptors are non-blocking: reading and writing all of them finds ready ones
+               without a pselect() syscall on top */
+            ret = 1;
+        } else {
+            if(spin) timeout = 0;
+            signal_time = now;
+
+            struct timespec ts = {.tv_sec = timeout / 1000000, .tv_nsec = timeout % 1000000 * 1000};
+            ret = pselect(maxfd + 1, &rfds, &wfds, NULL, timeout >= 0 ? &ts : NULL, &orig_sigmask);
+            err = errno;
+        }
+        uint64_t woken = time_usec();
+
+        stats.iterations++;
+        if(!spin) {
+            stats.sleep += woken - now;
+            stats.sleeps++;
+        } else {
+            stats.spin += woken - now;
         }
 
-        relay_fd_set(udprelay.outward, &rfds, &wfds);
-        maxfd = MAX(maxfd, udprelay.outward->fd);
+        /* Termination first, it may come in the same wakeup as other signals */
+        if(X_UNLIKELY(sigterm_evt)) break;
 
-        int ret = select(maxfd + 1, &rfds, &wfds, NULL, NULL);
+        /* Handle every signal which arrived, then start over as ready sets may be stale */
+        bool signalled = sighup_evt || sigusr1_evt || sigusr2_evt;
 
-        if(X_UNLIKELY((ret < 0 && errno != EAGAIN) || sigterm_evt)) {
+        if(sighup_evt) {
+            sighup_evt = false;
+            syslog(LOG_INFO, "Reloading config");
+            udprelay_reload(&udprelay);
+
+            tuning_apply(&tuning, &cmdline, &udprelay);
+            spin_limit = MIN(MAX(spin_limit, MIN_SPIN_USEC), udprelay.busy_poll);
+        }
+
+        if(sigusr2_evt) {
+            sigusr2_evt = false;
+            loop_stats_report(&stats, spin_limit);
+        }
+
+        if(sigusr1_evt) {
+            sigusr1_evt = false;
+            udprelay_toggle_capture(&udprelay);
+        }
+
+        if(signalled) continue;
+
+        if(X_UNLIKELY(ret < 0 && err != EAGAIN)) {
             /* signal or error */
-            if(ret < 0 && errno != EINTR) syslog(LOG_ERR, "%m");
+            if(err != EINTR) syslog(LOG_ERR, "%s", strerror(err));
             break;
+        }
 
-        } else if(ret > 0) {
-            /* Handle outward interface */
-            if(X_UNLIKELY(relay_handle(udprelay.outward, &rfds, &wfds) < 0)) {
-                break;
-            }
+        if(ret >= 0) udprelay_timer(&udprelay, time_usec());
 
-            /* Handle relays */
-            CLIST_FOREACH(r, udprelay.relays) {
-                if(X_UNLIKELY(relay_handle(r, &rfds, &wfds) < 0)) {
-                    syslog(LOG_WARNING, "Relay disabled");
-                    /* Remove from list */
-                    CLIST_DEL(udprelay.relays, r);
-                    free_relay(r);
-                    udprelay.relays_num--;
-                }
-            }
+        int received = 0;
+        if(ret > 0 && X_UNLIKELY((received = udprelay_handle(&udprelay, &rfds, &wfds)) < 0)) {
+            break;
+        }
 
-            /* Dispatch inbound */
-            void *buffer;
-            ssize_t sz = relay_receive(udprelay.outward, &buffer);
-            if(sz) {
-                if(X_UNLIKELY(udprelay_dispatch_inbound(&udprelay, buffer, sz) < 0)) {
-                    break;
-                }
-            }
+        uint64_t done = time_usec();
+        if(spin && !received) {
+            stats.spin += done - woken;
+        } else {
+            stats.busy += done - woken;
+            stats.busy_iterations++;
+        }
 
-            /* Dispatch relayed */
-            CLIST_FOREACH(r, udprelay.relays) {
-                void *buffer;
-                ssize_t sz = relay_receive(r, &buffer);
-                if(!sz) continue;
-
-                if(X_UNLIKELY(udprelay_dispatch_relayed(&udprelay, buffer, sz) < 0)) {
-                    syslog(LOG_WARNING, "Relay disabled");
-                    CLIST_DEL(udprelay.relays, r);
-                    free_relay(r);
-                    udprelay.relays_num--;
-                }
+        if(received) {
+            if(udprelay.busy_poll && !spin) {
+                spin_limit = woken - now < udprelay.busy_poll ?
+                    MIN(spin_limit * 2, udprelay.busy_poll) : MAX(spin_limit / 2, MIN_SPIN_USEC);
             }
+            work_time = done;
         }
     }
 
     syslog(LOG_INFO, "Terminating");
+    if(udprelay.busy_poll) loop_stats_report(&stats, spin_limit);
 
     udprelay_cleanup(&udprelay);
+    if(tuning.cpu) free(tuning.cpu);
+    if(tuning.sched) free(tuning.sched);
 
     return 0;
 }
\ No newline at end of file
@@ -27,8 +27,13 @@ SOFTWARE.
 #include <string.h>
 #include <stdarg.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <time.h>
 #include <unistd.h>
+#include <sched.h>
+#include <malloc.h>
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <sys/wait.h>
 
 #include "utils.h"
@@ -41,6 +46,43 @@ char *xstrdup(const char *str) {
     return (char*)memcpy(malloc(sz), str, sz);
 }
 
+/* Parse integer with optional k, M or G (decimal) multiplier suffix */
+uint64_t strtosize(const char *str) {
+    char *end;
+    uint64_t val = strtoull(str, &end, 0);
+
+    switch(*end) {
+        case 'g':
+        case 'G':
+            val *= 1000;
+            /* fallthrough */
+        case 'm':
+        case 'M':
+            val *= 1000;
+            /* fallthrough */
+        case 'k':
+        case 'K':
+            val *= 1000;
+    }
+
+    return val;
+}
+
+static uint64_t (*time_source)(void);
+
+uint64_t time_usec(void) {
+    if(time_source) return time_source();
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* NULL restores monotonic clock */
+void set_time_source(uint64_t (*source)(void)) {
+    time_source = source;
+}
+
 /* Version of snprintf with dynamic allocation */
 char *strdup_printf(const char *format, ...) {
     char buf[MAX_STR_LEN];
@@ -253,3 +295,108 @@ int xdaemon(const char *pid_file) {
 
     return 0;
 }
+
+/* Run calling thread on CPUs from list like 0,2-3, on any CPU if NULL */
+int set_cpus(const char *list) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+
+    if(!list) {
+        long n = sysconf(_SC_NPROCESSORS_CONF), i;
+        for(i = 0; i < n && i < CPU_SETSIZE; i++) CPU_SET(i, &set);
+        return sched_setaffinity(0, sizeof(set), &set);
+    }
+
+    const char *p = list;
+    while(*p) {
+        char *end;
+        long first = strtol(p, &end, 10), last = first, i;
+        if(end == p) break;
+
+        if(*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if(end == p) break;
+        }
+        if(first < 0 || last < first || last >= CPU_SETSIZE) break;
+
+        for(i = first; i <= last; i++) CPU_SET(i, &set);
+
+        p = end;
+        if(*p == ',') p++;
+        else if(*p) break;
+    }
+
+    if(*p || !CPU_COUNT(&set)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return sched_setaffinity(0, sizeof(set), &set);
+}
+
+/* Set scheduling policy of calling thread from spec like fifo:50, rr or other, to default if NULL */
+int set_sched(const char *spec) {
+    static const char *policies = "other\0fifo\0rr\0";
+    static const int policy_ids[] = {SCHED_OTHER, SCHED_FIFO, SCHED_RR};
+
+    char name[16] = "other";
+    const char *prio = NULL;
+    if(spec) {
+        const char *colon = strchr(spec, ':');
+        size_t len = colon ? (size_t)(colon - spec) : strlen(spec);
+        if(len >= sizeof(name)) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        memcpy(name, spec, len);
+        name[len] = '\0';
+        if(colon) prio = colon + 1;
+    }
+
+    int idx = str_index(policies, name);
+    if(idx < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int policy = policy_ids[idx];
+    struct sched_param param = {.sched_priority = prio ? strtol(prio, NULL, 10) : sched_get_priority_min(policy)};
+
+    return sched_setscheduler(0, policy, &param);
+}
+
+/* Stack pre-faulted by lock_memory() */
+#define PREFAULT_STACK (256 * 1024)
+
+/* glibc defaults restored by lock_memory(0) */
+#define DEFAULT_TRIM_THRESHOLD (128 * 1024)
+#define DEFAULT_MMAP_MAX 65536
+
+static void prefault_stack(void) {
+    volatile uint8_t stack[PREFAULT_STACK];
+    size_t i;
+    for(i = 0; i < sizeof(stack); i += 4096) stack[i] = 0;
+}
+
+/* Locked: freed memory stays in heap instead of being returned and faulted in again */
+static void keep_heap(int keep) {
+    mallopt(M_TRIM_THRESHOLD, keep ? -1 : DEFAULT_TRIM_THRESHOLD);
+    mallopt(M_MMAP_MAX, keep ? 0 : DEFAULT_MMAP_MAX);
+}
+
+/* Keep all memory of process in RAM, allocated later too, or unlock it */
+
+int lock_memory(int lock) {
+    keep_heap(lock);
+    if(!lock) return munlockall();
+
+    if(mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+        keep_heap(0);
+        return -1;
+    }
+
+    prefault_stack();
+    return 0;
+}
@@ -2,6 +2,7 @@
 #define UTILS_H
 
 #include <unistd.h>
+#include <stdint.h>
 
 #ifndef MIN
 #   define MIN(a,b) ((a) < (b) ? (a) : (b))
@@ -16,12 +17,20 @@ char *strreplace(char **dest, const char *str);
 char *strappend(char *dst, const char *src);
 int str_index(const char *array, const char *str);
 char *xstrdup(const char *str);
+uint64_t strtosize(const char *str);
+
+/* monotonic clock in microseconds, may be replaced with virtual one */
+uint64_t time_usec(void);
+void set_time_source(uint64_t (*source)(void));
 
 /* process control */
 int spawn_and_wait(char *const argv[]);
 int pipe_open(char *const argv[], pid_t *child_pid);
 int spawn_bg(char* const *argv, char* const *extra_env);
 int xdaemon(const char *pid_file);
+int set_cpus(const char *list);
+int set_sched(const char *spec);
+int lock_memory(int lock);
 
 #if defined _WIN32 || defined __CYGWIN__
     #ifdef __GNUC__